@@ -17,6 +17,9 @@
 #include <iot_api.h>
 #include <iot_logger.h>
 #include <iot_config.h>
+#include <iot_json.h>
+#include <iot_cbor.h>
+#include <iot_telemetry_queue.h>
 
 // *****************************************************************************
 
@@ -55,6 +58,9 @@ public:
      * 
      * begin() starts watchdog supervision for the application main task, startWatchdog().
      * 
+     * Log lines kept in RTC RAM during previous boot cycles without WiFi 
+     * connection are posted, see IotLogger::flush().
+     * 
      * If you need persistent
      * persistent storage other than RTC RAM, call
      * setPreferedPersistentStorage() before calling begin().
@@ -98,6 +104,13 @@ public:
      */
     String getTimeIso(time_t time);
 
+    /**
+     * Format the given time in ISO 8601 format into the given buffer
+     * without allocating memory.
+     * @return buf
+     */
+    const char * getTimeIso(char * buf, size_t bufLen, time_t time);
+
     /**
      * @return the current time as a string in ISO 8601 format, e.g. "2020-01-01T12:34:56Z"
      */
@@ -116,7 +129,9 @@ public:
      * 
      * On begin(), corresponding configuration values are read from 
      * *ntp_resync_s*, *ntp_timeout_ms*, *ntp_server1*, *ntp_server2*, *ntp_server3*.
-     * This method allows overwriting these values later.
+     * This method allows overwriting these values later. Changed NTP servers
+     * are applied to a running SNTP client, also when they are changed by
+     * IotConfig::updateConfig().
      */
     void setNtp(
         int resyncInterval_s = 24*60*60,
@@ -129,6 +144,8 @@ public:
      * @return the current time is considered plausible if it is after 2020-01-01, i.e. 50 years after the epoch
      */
     bool isTimePlausible();
+    /// @return whether the given time is after 2020-01-01, @see isTimePlausible()
+    bool isTimePlausible(time_t time);
 
     //bool waitUntilTimePlausible(unsigned long timeout_ms);
     /**
@@ -155,14 +172,42 @@ public:
     /**
      * Post telemetry data to the API. The body must be a valid JSON string.
      * 
-     * This method is similar to apiGet().
+     * This method is similar to apiGet(). While batching, the data is added
+     * to the batch instead, see IotApi::beginBatch().
+     * 
+     * If the telemetry queue is enabled (see IotTelemetryQueue::begin()),
+     * data which cannot be posted due to a missing WiFi connection, a 
+     * connection error or a server error is queued in NVRAM. After a 
+     * successful post, queued data is uploaded.
      */
     int postTelemetry(String kind, String jsonData, String apiPath = "telemetry/{project}/{device}/{kind}");
 
     /**
-     * Post telemetry data to the API. The body must be a valid JSON string.
+     * Post telemetry data built with an IotJsonWriter, @see postTelemetry().
+     * 
+     * The body is posted directly from the writer's buffer without copying
+     * it into a String. If the buffer overflowed, nothing is posted and
+     * HTTPC_ERROR_TOO_LESS_RAM is returned.
+     */
+    int postTelemetry(const char * kind, const IotJsonWriter& json, String apiPath = "telemetry/{project}/{device}/{kind}");
+
+    /**
+     * Post telemetry data built with an IotCborWriter using 
+     * Content-Type application/cbor, @see postTelemetry().
+     * 
+     * Binary data is always posted right away; it is neither added to
+     * a batch nor queued on failure.
+     */
+    int postTelemetry(const char * kind, const IotCborWriter& cbor, String apiPath = "telemetry/{project}/{device}/{kind}");
+
+    /**
+     * Post system telemetry like battery voltage, WiFi RSSI, boot count and
+     * firmware version to the API, @see postTelemetry().
      * 
-     * This method is similar to apiGet().
+     * The body is built in a fixed stack buffer. It is encoded as JSON or,
+     * if the configuration value *telemetry_format* is "cbor", as CBOR.
+     * CBOR is not used while batching, and data which must be queued is
+     * queued as JSON.
      */
     int postSystemTelemetry(String kind = "system", String apiPath = "telemetry/{project}/{device}/{kind}");
 
@@ -299,8 +344,33 @@ public:
     // System management: firmware
     // **********************************************************************
 
-    String getFirmwareVersion();
-    String getFirmwareSha256();
+    const String& getFirmwareVersion();
+    const String& getFirmwareSha256();
+
+
+    // **********************************************************************
+    // System management: updates
+    // **********************************************************************
+
+    /**
+     * Register a file to be synchronized by updateAll(), @see IotApi::syncFile().
+     */
+    void addSyncFile(String apiPath, String localPath, fs::FS& fs);
+
+    /**
+     * Update the configuration, the registered files and the firmware.
+     * 
+     * All known ETags are sent in a single request to the manifest 
+     * endpoint (@see IotApi::apiCheckForUpdates()), and only the stale
+     * resources are fetched, so a cycle without changes takes a single
+     * round trip. If the manifest endpoint is not available, all resources
+     * are checked individually like config.updateConfig(), 
+     * IotApi::syncFile() and IotApi::updateFirmware() do.
+     * 
+     * @return true if any resource was updated
+     */
+    bool updateAll(String firmwareApiPath = "file/{project}/{device}/firmware.bin", 
+        String manifestApiPath = "manifest/{project}/{device}");
 
 
     // **********************************************************************
@@ -390,7 +460,9 @@ public:
      * Put the system into deep sleep mode for the given duration.
      * Call this function for an orderly shutdown or a panic() situation.
      * This function keeps track of getActiveDuration_ms() and
-     * getLastSleepDuration_s(). It internally calls the deep sleep
+     * getLastSleepDuration_s(). Buffered log lines are flushed or
+     * kept in RTC RAM, see IotLogger::flush(), and a pending batch is
+     * sent, see IotApi::flushBatch(). It internally calls the deep sleep
      * handler registered with setDeepSleepHandler().
      * @param sleep_duration_s the sleep duration in seconds
      * @param panic set this to true if the sleep is due to a panic; it defaults to false for a regular sleep
@@ -465,7 +537,24 @@ private:
     IotConfigValue<int> _panicSleepDurationFactor;
     IotConfigValue<int> _panicSleepDurationMax_s;
 
+    IotConfigValue<String> _telemetryFormat;
+    struct SyncFile
+    {
+        String apiPath;
+        String localPath;
+        fs::FS * fs;
+    };
+    std::vector<SyncFile> _syncFiles;
+
+    String _telemetryPathKind;          // cache of the last telemetry path
+    String _telemetryPathPattern;
+    String _telemetryPath;
+
     static void _ntpSyncCallback(struct timeval *tv);
+    void _applyNtpServers();
+    const String& _getTelemetryPath(const char * kind, const String& apiPath);
+    int _postTelemetry(const String& apiPath, const uint8_t * body, size_t bodyLen);
+    template <typename Writer> void _writeSystemTelemetry(Writer& writer);
 };
 
 extern Iot iot;
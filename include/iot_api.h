@@ -6,13 +6,48 @@
 #pragma once
 
 #include <map>
+#include <vector>
+#include <functional>
 
 #include "Arduino.h"
 #include <HTTPClient.h>
 #include <WiFiClient.h>
+#include <FS.h>
+
+#include "iot_tls.h"
+#include "iot_url.h"
 
 // *****************************************************************************
 
+// size of the stack buffer for rendering URLs, longer URLs are rendered on the heap
+#ifndef IOT_API_MAX_URL_LEN
+#define IOT_API_MAX_URL_LEN 256
+#endif
+
+#ifndef IOT_API_MAX_URL_VARIABLES
+#define IOT_API_MAX_URL_VARIABLES 8
+#endif
+
+#ifndef IOT_API_URL_CACHE_SIZE
+#define IOT_API_URL_CACHE_SIZE 8
+#endif
+
+#ifndef IOT_API_CHUNK_SIZE
+#define IOT_API_CHUNK_SIZE 512
+#endif
+
+/**
+ * Producer of a streamed request body: fill buf with up to len bytes.
+ * @return the number of bytes written to buf, 0 at the end of the body
+ */
+typedef std::function<size_t(uint8_t * buf, size_t len)> IotBodyProducer;
+
+/**
+ * Sink for a streamed response body, called for each received part.
+ * @return false to abort receiving the response
+ */
+typedef std::function<bool(const uint8_t * data, size_t len)> IotBodySink;
+
 class IotApi
 {
 public:
@@ -22,6 +57,10 @@ public:
 
     IotApi();
     void begin();
+
+    /**
+     * Shut down the API, closing the kept connection, see disconnect().
+     */
     void end();
 
 
@@ -33,9 +72,12 @@ public:
      * Set the host and the base URL for API calls.
      * 
      * Base URLs starting with "https://" are considered secure and
-     * use TLS via WiFiClientSecure. 
+     * use TLS via IotWiFiClientSecure, which resumes TLS sessions
+     * across deep sleep. 
      * Base URLs starting with "http://" are considered insecure
      * and use plain HTTP via WifiClient.
+     * Variables like {project} are replaced in the base URL as well,
+     * @see getApiUrlForPath().
      * 
      * This method must be called before any other API call.
      * 
@@ -60,6 +102,13 @@ public:
      */
     void setDeviceName(String device);
 
+    /**
+     * Set an additional variable for API paths, e.g. "firmware" for
+     * {firmware}. At most IOT_API_MAX_URL_VARIABLES variables can be set,
+     * {project} and {device} are always available.
+     */
+    void setUrlVariable(const char * name, String value);
+
     /**
      * Optionally set additional HTTP headers to be used in any all requests.
      * 
@@ -161,8 +210,10 @@ public:
      * Return the effective URL for a given apiPath.
      * 
      * This function replaces variables known to the IoT system like
-     * {project} and {device} in the given path. 
-     * It also adds the API base URL.
+     * {project} and {device} in the API base URL followed by the given 
+     * path, @see IotUrlTemplate. The URLs of the most recently used
+     * paths are cached, so repeated requests like telemetry and logging 
+     * do not render their URL again.
      * 
      * @param apiPath the path relative to the API base URL, e.g. "/foo/{device}/bar"
      * @return the full URL, e.g. "https://api.example.com/iot/api/foo/e32-123/bar"
@@ -176,6 +227,50 @@ public:
         const char * requestType, String apiPath, String requestBody = "", std::map<String, String> requestHeader = {}, 
         const char * collectResponseHeaderKeys[] = {}, const size_t collectResponseHeaderKeysCount = 0);
 
+    /**
+     * @see apiRequest(), but with a request body given as a byte buffer,
+     * which avoids copying the body into a String.
+     */
+    int apiRequest(String& oResponse, std::map<String, String>& oResponseHeader, 
+        const char * requestType, String apiPath, const uint8_t * requestBody, size_t requestBodyLen, std::map<String, String> requestHeader = {}, 
+        const char * collectResponseHeaderKeys[] = {}, const size_t collectResponseHeaderKeysCount = 0);
+
+    /**
+     * @see apiRequest(), but write the body of a successful (2xx) response
+     * to the given stream while it is received instead of reading it into
+     * a String. The bodies of other responses are only logged.
+     */
+    int apiRequest(Stream& oResponseStream, std::map<String, String>& oResponseHeader, 
+        const char * requestType, String apiPath, const uint8_t * requestBody, size_t requestBodyLen, std::map<String, String> requestHeader = {}, 
+        const char * collectResponseHeaderKeys[] = {}, const size_t collectResponseHeaderKeysCount = 0);
+
+    /**
+     * @see apiRequest(), but stream both the request body and the body 
+     * of a successful response, so that large uploads and downloads run 
+     * in constant memory.
+     * 
+     * @param requestBodyStream the request body, read until its end
+     * @param requestBodyLen the length of the request body, sent as 
+     *        Content-Length; if 0, the length is unknown and the body is
+     *        sent with chunked transfer encoding
+     */
+    int apiRequest(Stream& oResponseStream, std::map<String, String>& oResponseHeader, 
+        const char * requestType, String apiPath, Stream& requestBodyStream, size_t requestBodyLen, std::map<String, String> requestHeader = {}, 
+        const char * collectResponseHeaderKeys[] = {}, const size_t collectResponseHeaderKeysCount = 0);
+
+    /**
+     * @see apiRequest(), but produce the request body with a callback,
+     * sent with chunked transfer encoding in parts of up to 
+     * IOT_API_CHUNK_SIZE bytes, and pass the body of a successful response 
+     * to a callback while it is received.
+     * 
+     * @param responseSink receives the response body; nullptr discards it
+     * @param requestBodyProducer produces the request body; nullptr for no body
+     */
+    int apiRequest(IotBodySink responseSink, std::map<String, String>& oResponseHeader, 
+        const char * requestType, String apiPath, IotBodyProducer requestBodyProducer, std::map<String, String> requestHeader = {}, 
+        const char * collectResponseHeaderKeys[] = {}, const size_t collectResponseHeaderKeysCount = 0);
+
     /**
      * Send a GET request to the API using the given API path 
      * and return the response body if successful (200 <= status code < 300). 
@@ -211,12 +306,40 @@ public:
      */
     int apiPost(String& oResponse, String apiPath, String body, std::map<String, String> headers = {});
 
+    /**
+     * @see apiPost(), but with a body given as a byte buffer.
+     */
+    int apiPost(String& oResponse, String apiPath, const uint8_t * body, size_t bodyLen, std::map<String, String> headers = {});
+
+    /**
+     * @see apiPost(), but discard the body of a successful response
+     * instead of reading it into a String, e.g. for telemetry and logs.
+     */
+    int apiPost(String apiPath, const uint8_t * body, size_t bodyLen, std::map<String, String> headers = {});
+
     /**
      * Send a HEAD request to the given URL and check if the server has an
      * update, based on the ETag or Last-Modified headers. The ETag and
      * Last-Modified headers are stored in NVRAM under the given keys.
      */
     bool apiCheckForUpdate(String apiPath, const char *nvram_etag_key, const char *nvram_date_key);
+
+    /**
+     * Check several resources for updates in a single request to a 
+     * manifest endpoint, instead of a conditional request per resource.
+     * 
+     * The request body is a JSON object mapping the API paths of the
+     * resources, with variables replaced, to their known ETags ("" if 
+     * unknown). The server answers with a JSON array of the stale paths,
+     * or with 204 or 304 if all resources are current.
+     * 
+     * @param etags the API paths and ETags of the resources
+     * @param oStalePaths receives the stale paths as given in etags
+     * @return the HTTP status code; other than 2xx or 304, e.g. if the 
+     *         server has no manifest endpoint, oStalePaths is empty
+     */
+    int apiCheckForUpdates(const std::map<String, String>& etags, std::vector<String>& oStalePaths, 
+        String apiPath = "manifest/{project}/{device}");
     
     /**
      * Set a timeout for connection to a remote server via http.
@@ -230,6 +353,93 @@ public:
     */
     void apiSetRequestTimeout(uint16_t timeout);
     
+    // **********************************************************************
+    // Batch requests
+    // **********************************************************************
+
+    /**
+     * Start collecting POST requests in a batch instead of sending them 
+     * immediately.
+     * 
+     * While batching, Iot::postTelemetry(), Iot::postSystemTelemetry() and
+     * IotLogger::postLog() add their requests to the batch using 
+     * addToBatch(). flushBatch() sends all collected items in a single
+     * request to a batch endpoint.
+     * 
+     * @param maxBytes the memory budget for collected items; adding an item 
+     *        which exceeds the budget flushes the batch first
+     */
+    void beginBatch(size_t maxBytes = 4096);
+
+    /**
+     * @return whether requests are collected in a batch, see beginBatch()
+     */
+    bool isBatching() const { return _isBatching; }
+
+    /**
+     * Add a POST request to the batch.
+     * 
+     * @param kind the kind of the item, e.g. "telemetry" or "log"
+     * @param apiPath the API path the item would be posted to without batching;
+     *        variables like {project} and {device} are replaced
+     * @param body the request body
+     * @param contentType the content type of the body; valid JSON bodies
+     *        are embedded as JSON values re-encoded on a single line,
+     *        other bodies as JSON strings
+     * @param time the time the item was recorded, 0 for none; this allows
+     *        posting data recorded in earlier boot cycles
+     * @return HTTP_CODE_ACCEPTED if the item was added, 
+     *         the status of apiPost() if not batching
+     */
+    int addToBatch(const char * kind, String apiPath, const String& body, const char * contentType = "application/json", time_t time = 0);
+
+    /**
+     * Send all collected items in a single POST request and stop batching.
+     * 
+     * The request body consists of JSON lines (application/x-ndjson), one 
+     * line per item: {"kind":...,"path":...,"contentType":...,"body":...},
+     * plus "time" in ISO 8601 format if given in addToBatch().
+     * The server responds with a JSON array containing a status code or an
+     * object with a "status" field for each item.
+     * 
+     * If oItemStatus is nullptr, items which could not be delivered due to
+     * a network or server error are kept: telemetry in the telemetryQueue
+     * if it is enabled, log lines in the RTC RAM journal of the logger.
+     * 
+     * @param oItemStatus if not nullptr, receives the status code of each item,
+     *        or the status code of the batch request if the response is not 
+     *        a valid item status array, or HTTPC_ERROR_TOO_LESS_RAM if the
+     *        item could not be added to the request; the caller is 
+     *        responsible for keeping undelivered items
+     * @return the HTTP response status code of the batch request, 0
+     *         if the batch was empty, or HTTPC_ERROR_TOO_LESS_RAM if no 
+     *         item could be added
+     */
+    int flushBatch(std::vector<int> * oItemStatus = nullptr, String apiPath = "batch/{project}/{device}");
+
+
+    // **********************************************************************
+    // Connection management
+    // **********************************************************************
+
+    /**
+     * Close the keep-alive connection to the API host.
+     * 
+     * All API requests in a wake cycle share a single keep-alive connection,
+     * avoiding repeated TCP and TLS handshakes. The connection is reopened
+     * on the next request if needed. Call this method before going to sleep,
+     * Iot::deepSleep() does so automatically.
+     */
+    void disconnect();
+
+    /// @return the number of API requests in this boot cycle
+    uint32_t getRequestCount() const { return _requestCount; }
+    /// @return the number of connections opened (TCP and, if secure, TLS handshakes) in this boot cycle
+    uint32_t getHandshakeCount() const { return _handshakeCount; }
+    /// @return the fraction of requests which reused a kept connection
+    float getConnectionReuseRatio() const;
+
+
     // **********************************************************************
     // Firmware
     // **********************************************************************
@@ -244,6 +454,32 @@ public:
     bool updateFirmware(String apiPath = "file/{project}/{device}/firmware.bin", std::map<String, String> header = {});
 
 
+    // **********************************************************************
+    // Files
+    // **********************************************************************
+
+    /**
+     * Synchronize a local file, e.g. in LittleFS or SPIFFS, with a file 
+     * from the API, like a model, a lookup table or a certificate.
+     * 
+     * The request is conditional (If-None-Match, If-Modified-Since), so
+     * an unchanged file is not downloaded again. The file is streamed into
+     * "<localPath>.part" and renamed to localPath when complete; the old
+     * file is removed right before. ETag and Last-Modified are kept in the 
+     * manifest "<localPath>.meta". An interrupted download is resumed with 
+     * a Range request on the next call if the server sent an ETag; 
+     * If-Range makes the server send the whole file if it changed meanwhile.
+     * 
+     * @param fs the file system, e.g. LittleFS, which must be mounted
+     * @return the HTTP status code, i.e. 200 or 206 if the file was 
+     *         downloaded and 304 if the local file is current
+     */
+    int syncFile(String apiPath, const char * localPath, fs::FS& fs);
+
+    /// @return the ETag of a file synchronized with syncFile(), "" if unknown
+    String getFileHttpEtag(const char * localPath, fs::FS& fs);
+
+
     // **********************************************************************
     // P r i v a t e
     // **********************************************************************
@@ -254,17 +490,40 @@ private:
     const char * _nvram_firmware_etag_key = "firmwareEtag";
     const char * _nvram_firmware_date_key = "firmwareDate";
 
+    struct BatchItem
+    {
+        const char * kind;
+        String path;
+        String contentType;
+        String body;
+        time_t time;
+    };
+
     String _baseUrl;
     std::map<String, String> _defaultRequestHeader;
+    std::vector<std::pair<String, String>> _mergedRequestHeader;   // defaults, base header and token
     String _projectName;
     String _deviceName;
+    std::map<String, String> _urlVariables;
+    std::map<String, String> _urlCache;     // API path -> URL
     String _provisioningToken;
     String _deviceToken;
+    String _firmwareEtag;       // cached from NVRAM in begin()
+    String _firmwareDate;
 
-    WiFiClientSecure * _wifiClientSecurePtr;
+    IotWiFiClientSecure * _wifiClientSecurePtr;
     WiFiClient * _wifiClientPtr;
     HTTPClient * _httpClientPtr;
 
+    bool _isBatching;
+    size_t _batchMaxBytes;
+    size_t _batchBytes;
+    std::vector<BatchItem> _batchItems;
+
+    uint32_t _requestCount;
+    uint32_t _reusedCount;
+    uint32_t _handshakeCount;
+
     /**
      * @return a WiFiClient instance, either secure or insecure, depending
      * on the API base URL. The instance is created on the first call.
@@ -289,9 +548,31 @@ private:
     String _replaceVars(String str);
 
     /**
-     * Add request header
+     * Render the path or URL with all variables.
+     */
+    String _renderUrl(const char * path);
+
+    /**
+     * Merge the built-in defaults, the base header and the device token
+     * into _mergedRequestHeader; called whenever one of them changes.
+     */
+    void _mergeRequestHeader();
+
+    /**
+     * Add the merged header and the request header, which overrides it;
+     * empty values remove a header.
      */
     void _addRequestHeader(HTTPClient& http, std::map<String, String> &header);
+
+    /**
+     * Common implementation of the apiRequest() overloads; the response
+     * body is read into oResponse or written to oResponseStream. The
+     * request body is taken from requestBody or, if not nullptr, 
+     * from requestBodyStream.
+     */
+    int _apiRequest(String * oResponse, Stream * oResponseStream, std::map<String, String>& oResponseHeader, 
+        const char * requestType, String apiPath, const uint8_t * requestBody, size_t requestBodyLen, Stream * requestBodyStream,
+        std::map<String, String> requestHeader, const char * collectResponseHeaderKeys[], const size_t collectResponseHeaderKeysCount);
     /**
      * Send a HEAD request to the given URL and check if the server has an 
      * update, based on the ETag or Last-Modified headers. 
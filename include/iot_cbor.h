@@ -0,0 +1,79 @@
+/**
+ * ESP32 generic firmware (Arduino based)
+ * Copyright (c) 2023 clausgf@github. See LICENSE.md for legal information.
+ */
+
+#pragma once
+
+#include "Arduino.h"
+
+// *****************************************************************************
+
+/**
+ * Streaming CBOR (RFC 8949) writer into a fixed, caller-provided buffer.
+ *
+ * The writer has the same interface as IotJsonWriter, so telemetry can be
+ * encoded by the same code in either format. Objects and arrays are written
+ * with indefinite length, integers use the shortest encoding, and numbers
+ * with decimals are rounded and written as single precision floats if this
+ * does not lose the requested precision. If the buffer is too small,
+ * the output is truncated and isOverflow() returns true.
+ *
+ * Example:
+ *     uint8_t buf[128];
+ *     IotCborWriter cbor(buf, sizeof(buf));
+ *     cbor.beginObject().field("temperature", 21.5, 1).field("unit", "C").endObject();
+ *     iot.postTelemetry("sensors", cbor);
+ */
+class IotCborWriter
+{
+public:
+    IotCborWriter(uint8_t * buf, size_t bufLen);
+
+    /// Discard the output and start again
+    void clear();
+
+    IotCborWriter& beginObject();
+    IotCborWriter& endObject();
+    IotCborWriter& beginArray();
+    IotCborWriter& endArray();
+
+    /// Write an object member name, followed by a value
+    IotCborWriter& key(const char * name);
+
+    IotCborWriter& value(int v) { return value((long long)v); }
+    IotCborWriter& value(unsigned int v) { return value((unsigned long long)v); }
+    IotCborWriter& value(long v) { return value((long long)v); }
+    IotCborWriter& value(unsigned long v) { return value((unsigned long long)v); }
+    IotCborWriter& value(long long v);
+    IotCborWriter& value(unsigned long long v);
+    /// Write a number rounded to the given number of decimals; NaN and infinity are written as null
+    IotCborWriter& value(double v, int decimals = 2);
+    IotCborWriter& value(bool v);
+    /// Write a text string; nullptr is written as null
+    IotCborWriter& value(const char * v);
+    IotCborWriter& value(const String& v) { return value(v.c_str()); }
+    IotCborWriter& valueNull();
+    /// Write an already encoded CBOR data item as is
+    IotCborWriter& rawValue(const uint8_t * cbor, size_t len);
+
+    /// Write an object member, i.e. key() followed by value()
+    template <typename T>
+    IotCborWriter& field(const char * name, T v) { return key(name).value(v); }
+    IotCborWriter& field(const char * name, const String& v) { return key(name).value(v); }
+    IotCborWriter& field(const char * name, double v, int decimals) { return key(name).value(v, decimals); }
+
+    const uint8_t * data() const { return _buf; }
+    size_t length() const { return _len; }
+    bool isOverflow() const { return _isOverflow; }
+
+private:
+    uint8_t * _buf;
+    size_t _bufLen;
+    size_t _len;
+    bool _isOverflow;
+
+    void _append(uint8_t b);
+    void _append(const uint8_t * data, size_t len);
+    void _appendHead(uint8_t majorType, uint64_t arg);
+};
@@ -6,31 +6,94 @@
 #pragma once
 
 #include <map>
+#include <vector>
+#include <functional>
 
 #include "Arduino.h"
 #include <Preferences.h>
+#include <nvs.h>
+
+#include "iot_util.h"
+#include "iot_json.h"
 
 // *****************************************************************************
 
+#ifndef IOT_CONFIG_MAX_VALUES
+#define IOT_CONFIG_MAX_VALUES 48
+#endif
+
+#ifndef IOT_CONFIG_RTC_SNAPSHOT_SIZE
+#define IOT_CONFIG_RTC_SNAPSHOT_SIZE 1024
+#endif
+
 class IotConfig;
 
+/**
+ * Binary configuration value, e.g. a calibration table.
+ * 
+ * In the JSON configuration, a blob is a base64 string limited to
+ * IOT_JSON_STREAM_MAX_VALUE_LEN characters, i.e. at most 192 bytes with
+ * the default limit of 256. A missing or empty blob reads as the default.
+ */
+typedef std::vector<uint8_t> IotBlob;
+
+/**
+ * Type tags of configuration values.
+ * 
+ * In NVRAM, int32 and int64 are stored as integers, bool as uint8, 
+ * String as string, and float, double and IotBlob as blobs 
+ * (compatible with Preferences::getFloat(), getDouble() and getBytes()).
+ * In the JSON configuration, blobs are base64 encoded strings.
+ */
+enum IotConfigType 
+{ 
+    IOT_CONFIG_INT32, IOT_CONFIG_INT64, IOT_CONFIG_BOOL, IOT_CONFIG_FLOAT, 
+    IOT_CONFIG_DOUBLE, IOT_CONFIG_STRING, IOT_CONFIG_BLOB 
+};
+
+/// Compile time mapping of value types to type tags
+template <typename T> struct IotConfigTypeOf;
+template <> struct IotConfigTypeOf<int32_t> { static const IotConfigType type = IOT_CONFIG_INT32; };
+template <> struct IotConfigTypeOf<int64_t> { static const IotConfigType type = IOT_CONFIG_INT64; };
+template <> struct IotConfigTypeOf<bool> { static const IotConfigType type = IOT_CONFIG_BOOL; };
+template <> struct IotConfigTypeOf<float> { static const IotConfigType type = IOT_CONFIG_FLOAT; };
+template <> struct IotConfigTypeOf<double> { static const IotConfigType type = IOT_CONFIG_DOUBLE; };
+template <> struct IotConfigTypeOf<String> { static const IotConfigType type = IOT_CONFIG_STRING; };
+template <> struct IotConfigTypeOf<IotBlob> { static const IotConfigType type = IOT_CONFIG_BLOB; };
+
 /**
  * Interface for configuration values.
+ * 
+ * The type tag is set at construction time from IotConfigTypeOf, so
+ * type checks do not need virtual calls.
  */
 class IotPersistableConfigValue
 {
 public:
+    IotPersistableConfigValue(IotConfigType type): _type(type) {}
+
     virtual void readFromNvram(Preferences& preferences) = 0;
+    /// read the value from an NVRAM entry as kept in the RTC snapshot, see IotConfig::begin()
+    virtual void readFromSnapshot(nvs_type_t type, const uint8_t * data, size_t len) = 0;
+    virtual void resetToDefault() = 0;
+    virtual void notifyChanged() = 0;
     virtual const char * getNvramKey() const = 0;
-    virtual bool isInt32() const = 0;
-    virtual bool isBool() const = 0;
-    virtual bool isString() const = 0;
+
+    IotConfigType getType() const { return _type; }
+    bool isInt32() const { return _type == IOT_CONFIG_INT32; }
+    bool isBool() const { return _type == IOT_CONFIG_BOOL; }
+    bool isString() const { return _type == IOT_CONFIG_STRING; }
+
+private:
+    const IotConfigType _type;
 };
 
 /**
  * Wrapper class for configuration values.
  * 
  * The value is stored in NVRAM and can be updated from the server.
+ * Supported types are int32_t, int64_t, bool, float, double, String and
+ * IotBlob, for enums see IotConfigEnum.
  */
 template <typename T>
 class IotConfigValue: public IotPersistableConfigValue
@@ -44,11 +107,22 @@ public:
     T get() const { return _value; }
     void set(T value) { _value = value; }
 
+    /**
+     * Set a handler which is called after the value was changed by
+     * IotConfig::updateConfig(). The handler is called once per update,
+     * after all changed values were published. Assignments by the 
+     * application do not call the handler.
+     * 
+     * @return the previous handler
+     */
+    std::function<void()> setChangeHandler(std::function<void()> changeHandler);
+
     virtual void readFromNvram(Preferences& preferences);
+    virtual void readFromSnapshot(nvs_type_t type, const uint8_t * data, size_t len);
+    /// reset the value to the value given in the constructor
+    virtual void resetToDefault() { _value = _defaultValue; }
+    virtual void notifyChanged() { if (_changeHandler) { _changeHandler(); } }
     virtual const char * getNvramKey() const { return _nvram_key; }
-    virtual bool isInt32() const;
-    virtual bool isBool() const;
-    virtual bool isString() const;
 
     IotConfigValue<T>& operator=(const T& value) { set(value); return *this; }
     operator T() const { return _value; }
@@ -57,6 +131,29 @@ private:
     const char *_config_key;
     const char *_nvram_key;
     T _value;
+    T _defaultValue;
+    std::function<void()> _changeHandler;
+};
+
+/**
+ * Configuration value for enums, stored as int32.
+ */
+template <typename E>
+class IotConfigEnum: private IotConfigValue<int32_t>
+{
+public:
+    using IotConfigValue<int32_t>::setChangeHandler;
+
+    IotConfigEnum(IotConfig& config, E value, const char *key):
+        IotConfigValue<int32_t>(config, (int32_t)value, key) {}
+    IotConfigEnum(IotConfig& config, E value, const char *config_key, const char *nvram_key):
+        IotConfigValue<int32_t>(config, (int32_t)value, config_key, nvram_key) {}
+
+    E get() const { return (E)IotConfigValue<int32_t>::get(); }
+    void set(E value) { IotConfigValue<int32_t>::set((int32_t)value); }
+
+    IotConfigEnum<E>& operator=(const E& value) { set(value); return *this; }
+    operator E() const { return get(); }
 };
 
 // *****************************************************************************
@@ -81,6 +178,17 @@ public:
     IotConfig& operator=(const IotConfig&) = delete;
 
     IotConfig();
+    /**
+     * Load the configuration section and publish it to the registered values.
+     * 
+     * The raw NVRAM entries of the section are kept in a checksummed snapshot
+     * in RTC RAM. After waking from deep sleep, the configuration is restored
+     * from the snapshot without reading NVRAM. The snapshot is invalidated 
+     * when a value is changed, e.g. by updateConfig(), and rebuilt from NVRAM
+     * on the next begin(). There is a single snapshot of at most 
+     * IOT_CONFIG_RTC_SNAPSHOT_SIZE bytes, used by the instance which 
+     * loaded it last - typically the global config instance.
+     */
     void begin(
         const char * apiPath = "file/{project}/{device}/config.json", 
         const char * nvramSection = "iot-cfg", 
@@ -94,23 +202,59 @@ public:
     // **********************************************************************
 
     void readConfigFromPreferences();
+    /**
+     * Register a configuration value; called by the IotConfigValue constructors.
+     * 
+     * The registry is a sorted array of at most IOT_CONFIG_MAX_VALUES entries 
+     * keyed by the configuration key, which must be a string constant. It does
+     * not allocate memory.
+     */
     void registerConfigValuePtr(const char *configKey, IotPersistableConfigValue* configValuePtr);
 
+    /// @return the configuration value registered for the key or nullptr; uses a binary search
+    IotPersistableConfigValue * findConfigValuePtr(const char *configKey) const;
+
     /**
      * Check if the server has a new configuration, based on the ETag and 
      * Last-Modified headers.
+     * 
+     * The request offers delta encoding (RFC 3229) with the header
+     * "A-IM: merge-patch". The server may answer with status 226 and a
+     * JSON merge patch (RFC 7386) relative to the configuration identified
+     * by the ETag, containing only the changed keys, or with status 200
+     * and the full configuration. In both cases only the keys received are
+     * written, and a key with the value null is removed from NVRAM and 
+     * its value is reset to the default. Only changed values are published
+     * to their IotConfigValue objects, and their change handlers are
+     * called, see IotConfigValue::setChangeHandler().
      * If available the new configuration is downloaded and stored in NVRAM.
+     * The configuration is parsed while it is received, 
+     * see IotJsonStreamParser for the limits of keys and string values.
      * It is available via @see getConfigString and @see getConfigInt32.
+     * If parsing fails part-way, the values received so far are stored and
+     * published as well, but the ETag is kept so that the configuration is
+     * downloaded again with the next call.
      * 
-     * @return true if a new configuration was downloaded
+     * @return true if a new configuration was downloaded completely
      */
     bool updateConfig();
 
+    /// @return the API path of the configuration given in begin()
+    const char * getApiPath() const { return _apiPath; }
+
     /// @return the Etag of the current configuration for diagnostics
     String getConfigHttpEtag() { return getConfigString(_nvramEtagKey, ""); }
     /// @return the last modified date of the current configuration for diagnostics
     String getConfigHttpDate() { return getConfigString(_nvramDateKey, ""); }
 
+    /**
+     * Getters and setters for arbitrary values in the configuration section.
+     * 
+     * The section is read into a RAM cache once in begin(), so the getters
+     * do not access NVRAM. The setters write through to NVRAM and skip
+     * writing values which did not change. Before begin(), NVRAM is
+     * accessed directly.
+     */
     int32_t getConfigInt32(const char *key, int32_t defaultValue = 0);
     void setConfigInt32(const char *key, int32_t value);
     bool getConfigBool(const char *key, bool defaultValue = false);
@@ -131,7 +275,33 @@ private:
     const char * _nvramSection;
     const char * _nvramEtagKey;
     const char * _nvramDateKey;
-    std::map<String, IotPersistableConfigValue*> _configMap;
+    struct ConfigValueEntry
+    {
+        const char * configKey;
+        IotPersistableConfigValue * valuePtr;
+    };
+    ConfigValueEntry _configValues[IOT_CONFIG_MAX_VALUES];
+    size_t _configValueCount;
+
+    struct CacheEntry
+    {
+        nvs_type_t type;        // NVS_TYPE_I32, NVS_TYPE_U8 (bool) or NVS_TYPE_STR
+        int32_t intValue;
+        String stringValue;
+    };
+    bool _isCacheLoaded;
+    std::map<String, CacheEntry> _cache;
+
+    void _loadCache();
+    bool _loadCacheEntry(nvs_handle_t handle, const nvs_entry_info_t& info);
+    void _cacheEntry(nvs_type_t type, const char * key, const uint8_t * data, size_t len);
+    bool _appendSnapshotRecord(nvs_type_t type, const char * key, const uint8_t * data, size_t len);
+    void _saveSnapshot(bool isComplete);
+    bool _loadFromSnapshot();
+    void _updateCache(const char * key, nvs_type_t type, int32_t intValue, const String& stringValue = "");
+    void _storeConfigValue(IotNvramTransaction& transaction, const char * configKey, 
+        IotJsonStreamParser::ValueType type, const char * value, 
+        std::vector<IotPersistableConfigValue*>& oChangedValues);
 };
 
 extern IotConfig config;
@@ -0,0 +1,161 @@
+/**
+ * ESP32 generic firmware (Arduino based)
+ * Copyright (c) 2023 clausgf@github. See LICENSE.md for legal information.
+ */
+
+#pragma once
+
+#include <functional>
+
+#include "Arduino.h"
+
+// *****************************************************************************
+
+/**
+ * Streaming JSON writer into a fixed, caller-provided buffer.
+ *
+ * The writer does not allocate memory. Numbers are formatted and strings
+ * are escaped directly into the buffer, commas between members and
+ * elements are inserted automatically. If the buffer is too small,
+ * the output is truncated and isOverflow() returns true.
+ *
+ * Example:
+ *     char buf[128];
+ *     IotJsonWriter json(buf, sizeof(buf));
+ *     json.beginObject().field("temperature", 21.5, 1).field("unit", "C").endObject();
+ *     iot.postTelemetry("sensors", json);
+ */
+class IotJsonWriter
+{
+public:
+    IotJsonWriter(char * buf, size_t bufLen);
+
+    /// Discard the output and start again
+    void clear();
+
+    IotJsonWriter& beginObject();
+    IotJsonWriter& endObject();
+    IotJsonWriter& beginArray();
+    IotJsonWriter& endArray();
+
+    /// Write an object member name, followed by a value
+    IotJsonWriter& key(const char * name);
+
+    IotJsonWriter& value(int v) { return value((long long)v); }
+    IotJsonWriter& value(unsigned int v) { return value((unsigned long long)v); }
+    IotJsonWriter& value(long v) { return value((long long)v); }
+    IotJsonWriter& value(unsigned long v) { return value((unsigned long long)v); }
+    IotJsonWriter& value(long long v);
+    IotJsonWriter& value(unsigned long long v);
+    /// Write a number with the given number of decimals; NaN and infinity are written as null
+    IotJsonWriter& value(double v, int decimals = 2);
+    IotJsonWriter& value(bool v);
+    /// Write an escaped string; nullptr is written as null
+    IotJsonWriter& value(const char * v);
+    IotJsonWriter& value(const String& v) { return value(v.c_str()); }
+    IotJsonWriter& valueNull();
+    /// Write an already serialized JSON value as is
+    IotJsonWriter& rawValue(const char * json);
+
+    /// Write an object member, i.e. key() followed by value()
+    template <typename T>
+    IotJsonWriter& field(const char * name, T v) { return key(name).value(v); }
+    IotJsonWriter& field(const char * name, const String& v) { return key(name).value(v); }
+    IotJsonWriter& field(const char * name, double v, int decimals) { return key(name).value(v, decimals); }
+
+    const char * c_str() const { return _buf; }
+    size_t length() const { return _len; }
+    bool isOverflow() const { return _isOverflow; }
+
+private:
+    char * _buf;
+    size_t _bufLen;
+    size_t _len;
+    bool _isOverflow;
+    bool _needsComma;
+
+    void _append(char c);
+    void _append(const char * str, size_t len);
+    void _beginValue();
+    void _appendEscaped(const char * str);
+};
+
+// *****************************************************************************
+
+#ifndef IOT_JSON_STREAM_MAX_KEY_LEN
+#define IOT_JSON_STREAM_MAX_KEY_LEN 32
+#endif
+#ifndef IOT_JSON_STREAM_MAX_VALUE_LEN
+#define IOT_JSON_STREAM_MAX_VALUE_LEN 256
+#endif
+
+/**
+ * Streaming parser for flat JSON objects like configuration files.
+ *
+ * The parser is a Stream, so it can be fed directly by
+ * HTTPClient::writeToStream() or by write(). It never holds more than one
+ * member: each member of the top level object is passed to the callback
+ * as soon as it is complete. Nested objects and arrays are skipped and 
+ * reported with type IOT_JSON_NESTED and an empty value. Members with keys
+ * or string values exceeding the limits IOT_JSON_STREAM_MAX_KEY_LEN and 
+ * IOT_JSON_STREAM_MAX_VALUE_LEN are skipped with an error message.
+ */
+class IotJsonStreamParser: public Stream
+{
+public:
+    enum ValueType { IOT_JSON_STRING, IOT_JSON_NUMBER, IOT_JSON_BOOL, IOT_JSON_NULL, IOT_JSON_NESTED };
+
+    /**
+     * Callback for each member of the top level object.
+     * @param key the unescaped key
+     * @param type the type of the value
+     * @param value the unescaped string or the literal as in the document, 
+     *              e.g. "42", "true", "null"
+     */
+    typedef std::function<void(const char * key, ValueType type, const char * value)> MemberCallback;
+
+    IotJsonStreamParser(MemberCallback callback);
+
+    /// Reset the parser to parse another document
+    void clear();
+
+    /// @return true if a complete top level object was parsed
+    bool isDone() const { return _state == S_DONE; }
+    /// @return true if the document is not valid JSON or not an object
+    bool isError() const { return _state == S_ERROR; }
+    /// @return the number of members passed to the callback
+    size_t getMemberCount() const { return _memberCount; }
+
+    // Stream interface, data written is parsed
+    virtual size_t write(uint8_t c) { _feed(c); return 1; }
+    virtual size_t write(const uint8_t * buf, size_t size);
+    virtual int available() { return 0; }
+    virtual int read() { return -1; }
+    virtual int peek() { return -1; }
+    virtual void flush() {}
+
+private:
+    enum State { S_START, S_KEY_OR_END, S_KEY, S_COLON, S_VALUE, S_STRING, S_LITERAL, S_NESTED, S_COMMA_OR_END, S_DONE, S_ERROR };
+
+    MemberCallback _callback;
+    State _state;
+    char _key[IOT_JSON_STREAM_MAX_KEY_LEN + 1];
+    char _value[IOT_JSON_STREAM_MAX_VALUE_LEN + 1];
+    size_t _keyLen;
+    size_t _valueLen;
+    bool _isTruncated;
+    bool _isEscape;
+    int _unicodeDigits;         // number of \uXXXX digits still expected, 0 otherwise
+    uint16_t _unicode;
+    int _depth;                 // nesting depth of skipped values
+    bool _isInNestedString;
+    size_t _memberCount;
+
+    void _feed(char c);
+    void _startString();
+    bool _appendStringChar(char c, char * buf, size_t bufSize, size_t& len);
+    void _appendChar(char c, char * buf, size_t bufSize, size_t& len);
+    void _finishLiteral();
+    void _emit(ValueType type);
+    void _error(char c);
+};
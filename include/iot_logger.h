@@ -12,6 +12,46 @@
 
 // *****************************************************************************
 
+/**
+ * Maximum log level compiled into the application when using the
+ * IOT_LOG* macros, e.g. -DIOT_LOG_MAX_LEVEL=2 to keep errors, warnings
+ * and infos only. Calls with higher levels are removed completely by 
+ * the compiler, including the evaluation of their arguments.
+ * Values correspond to IotLogger::LogLevel.
+ */
+#ifndef IOT_LOG_MAX_LEVEL
+#define IOT_LOG_MAX_LEVEL 4
+#endif
+
+/**
+ * Maximum number of characters of a string argument kept in a deferred
+ * log record, see IotLogger::setDeferredFormatting(); at most 255.
+ */
+#ifndef IOT_LOG_RECORD_MAX_STRING_LEN
+#define IOT_LOG_RECORD_MAX_STRING_LEN 48
+#endif
+
+#define IOT_LOG_LIKELY(x) __builtin_expect(!!(x), 1)
+
+/**
+ * Log with the given level if enabled at compile time (IOT_LOG_MAX_LEVEL) 
+ * and at runtime (IotLogger::setLogLevel()). Arguments are only evaluated
+ * for enabled levels.
+ */
+#define IOT_LOG(level, tag, format, ...) do { \
+        if ((int)(level) <= IOT_LOG_MAX_LEVEL && IOT_LOG_LIKELY(logger.isLevelEnabled(level))) { \
+            logger.logf((level), (tag), (format), ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define IOT_LOGE(tag, format, ...) IOT_LOG(IotLogger::IOT_LOGLEVEL_ERROR, tag, format, ##__VA_ARGS__)
+#define IOT_LOGW(tag, format, ...) IOT_LOG(IotLogger::IOT_LOGLEVEL_WARNING, tag, format, ##__VA_ARGS__)
+#define IOT_LOGI(tag, format, ...) IOT_LOG(IotLogger::IOT_LOGLEVEL_INFO, tag, format, ##__VA_ARGS__)
+#define IOT_LOGD(tag, format, ...) IOT_LOG(IotLogger::IOT_LOGLEVEL_DEBUG, tag, format, ##__VA_ARGS__)
+#define IOT_LOGV(tag, format, ...) IOT_LOG(IotLogger::IOT_LOGLEVEL_VERBOSE, tag, format, ##__VA_ARGS__)
+
+// *****************************************************************************
+
 class IotLogger
 {
 public:
@@ -37,8 +77,87 @@ public:
      */
     void setLogLevel(LogLevel level);
 
+    /**
+     * @return whether output with the given level is enabled at runtime
+     */
+    bool isLevelEnabled(LogLevel level) const { return level <= _logLevel; }
+
+    /**
+     * Configure buffering of log lines posted to the API.
+     * 
+     * Log lines are collected in a buffer of bufferSize bytes and posted 
+     * as a single text/plain request, see postLog(). The buffer is flushed
+     * when its content exceeds flushThreshold bytes, when the oldest
+     * buffered line is older than maxAge_ms, or when flush() is called
+     * explicitly, e.g. by Iot::deepSleep().
+     * Lines which do not fit into the buffer are dropped and counted,
+     * see getDroppedCount(). After a failed flush, automatic flushes are
+     * delayed with an exponential backoff of up to a minute, so lines are
+     * dropped rather than each waiting for another request.
+     * 
+     * A bufferSize of 0 disables buffering, every line is posted immediately.
+     */
+    void setBuffer(size_t bufferSize = 2048, size_t flushThreshold = 1536, unsigned long maxAge_ms = 5000);
+
+    /**
+     * Post all buffered log lines to the API if WiFi is connected.
+     * 
+     * Log lines from the RTC RAM journal, i.e. lines logged without WiFi
+     * connection in this or previous boot cycles, are posted in the same request.
+     * 
+     * @param persistOnFailure if true, buffered lines which cannot be posted
+     *        are moved to the RTC RAM journal to survive deep sleep
+     * @return the HTTP response status code or 0 if there was nothing to post
+     */
+    int flush(bool persistOnFailure = false);
+
+    /**
+     * @return the number of bytes used in the RTC RAM journal
+     */
+    size_t getJournalLength() const;
+
+    /**
+     * Persist complete log lines, separated by newlines, in the RTC RAM
+     * journal, e.g. lines which could not be posted in a batch request.
+     * They are posted with the next flush().
+     */
+    void persistToJournal(const char * lines);
+
+    /**
+     * Flush the buffer if its size or age threshold is reached. 
+     * Call this periodically in long running loops which do not log.
+     */
+    void loop();
+
+    /**
+     * Enable or disable deferred formatting of buffered log lines.
+     * 
+     * With deferred formatting, a log call only stores the format string
+     * pointer and the raw argument values in the buffer. The lines are 
+     * formatted when the buffer is flushed. Format strings and tags
+     * must be string literals, which remain valid until the flush.
+     * Formats using "*" width/precision or unsupported length modifiers 
+     * are formatted immediately.
+     * 
+     * Deferred formatting requires buffering, see setBuffer(). Without
+     * WiFi connection, lines are formatted immediately for the RTC RAM journal.
+     * 
+     * String arguments (%s) are copied with at most 
+     * IOT_LOG_RECORD_MAX_STRING_LEN characters, 48 by default; longer 
+     * strings are truncated and end with "...".
+     */
+    void setDeferredFormatting(bool deferred);
+
+    /**
+     * @return the number of log lines dropped due to a full buffer
+     */
+    uint32_t getDroppedCount() const { return _droppedCount; }
+
     /**
      * Log output with given level, format and arguments referenced by ap.
+     * 
+     * Without WiFi connection, the line is kept in a journal in RTC RAM
+     * and posted with the next flush().
      */
     void logv(LogLevel level, const char *tag, const char* format, va_list ap);
 
@@ -48,6 +167,8 @@ public:
     void logf(LogLevel level, const char *tag, const char* format...);
 
     // --- logging helpers ---
+    // prefer the IOT_LOG* macros, which skip disabled levels at compile time
+    // and do not evaluate arguments for disabled levels at runtime
     void error(const char *tag, const char* format...);
     void warn(const char *tag, const char* format...);
     void info(const char *tag, const char* format...);
@@ -69,6 +190,56 @@ public:
 
 private:
     LogLevel _logLevel;
+
+    char * _buffer;
+    size_t _bufferSize;
+    size_t _bufferLen;
+    size_t _flushThreshold;
+    unsigned long _maxAge_ms;
+    unsigned long _bufferStart_ms;
+    uint32_t _droppedCount;
+    uint32_t _reportedDroppedCount;     // _droppedCount when last reported in flush()
+    unsigned long _flushFailed_ms;      // time of the last failed flush
+    unsigned long _flushRetryDelay_ms;  // delay of automatic flushes after a failure, 0 if none
+    bool _isFlushing;
+    bool _isDeferred;
+
+    /**
+     * Reserve len bytes at the end of the buffer, allocating the buffer 
+     * and flushing it if needed.
+     * @return nullptr if the data has to be dropped
+     */
+    char * _reserveBuffer(size_t len);
+
+    /**
+     * Append a log line to the buffer.
+     * @return false if the line was dropped
+     */
+    bool _appendToBuffer(const char * line);
+
+    /**
+     * Append a deferred log record to the buffer, see setDeferredFormatting().
+     * @return false if the record was dropped
+     */
+    bool _appendRecordToBuffer(LogLevel level, const char * tag, unsigned long ms, const char * format, va_list ap);
+
+    /**
+     * Format a deferred log record as a log line.
+     * @return the size of the record in bytes
+     */
+    size_t _formatRecord(const uint8_t * record, char * out, size_t outLen) const;
+    void _bufferToString(String& oText) const;
+    bool _isFlushDue() const;
+    /// @return true if automatic flushes are delayed after a failed flush
+    bool _isFlushRetryDelayed() const;
+
+    /**
+     * Persist a log line in the RTC RAM journal, dropping the oldest lines 
+     * if the journal is full. A nullptr tag denotes a complete log line.
+     */
+    void _appendToJournal(LogLevel level, const char * tag, unsigned long ms, const char * text);
+    void _journalToString(String& oText) const;
+    void _persistBuffer();
 };
 
 extern IotLogger logger;
@@ -0,0 +1,109 @@
+/**
+ * ESP32 generic firmware (Arduino based)
+ * Copyright (c) 2023 clausgf@github. See LICENSE.md for legal information.
+ */
+
+#pragma once
+
+#include "Arduino.h"
+#include <Preferences.h>
+
+// *****************************************************************************
+
+/**
+ * Persistent store-and-forward queue for telemetry which could not be posted.
+ *
+ * Records are kept in a dedicated NVRAM section as an append-only ring of
+ * record slots: each record is written once into the next slot, and slots
+ * are reused in round-robin order, spreading writes evenly over all slots.
+ * The queue is bounded by the number of slots, the total number of bytes
+ * and the age of the records; the oldest records are dropped first.
+ *
+ * Records keep the time they were recorded. They are uploaded in batches
+ * with their original timestamps, see drain() and IotApi::flushBatch().
+ * Records queued before the clock was set have no timestamp; they are 
+ * uploaded without time and never expire.
+ *
+ * The queue is disabled until begin() is called.
+ * A default instance used by Iot::postTelemetry() is available in the
+ * global @see telemetryQueue variable.
+ */
+class IotTelemetryQueue
+{
+public:
+    // disallow copying & assignment
+    IotTelemetryQueue(const IotTelemetryQueue&) = delete;
+    IotTelemetryQueue& operator=(const IotTelemetryQueue&) = delete;
+
+    IotTelemetryQueue();
+
+    /**
+     * Enable the queue.
+     *
+     * @param nvramSection the NVRAM section used exclusively by the queue
+     * @param maxRecords the number of record slots, must not be 0;
+     *        changing it discards the queued records
+     * @param maxBytes the maximum number of bytes of all queued records
+     * @param maxAge_s records older than this are dropped instead of uploaded
+     */
+    void begin(const char * nvramSection = "iot-tq", uint16_t maxRecords = 32,
+        size_t maxBytes = 8192, uint32_t maxAge_s = 7 * 24 * 60 * 60);
+    void end();
+
+    bool isEnabled() const { return _nvramSection != nullptr; }
+
+    /**
+     * Append a record to the queue, dropping the oldest records if needed.
+     *
+     * @param time the time the data was recorded; it is stored as 0, i.e.
+     *        unknown, unless it is plausible, @see Iot::isTimePlausible()
+     * @param apiPath the API path to post the data to
+     * @param body the JSON data
+     * @return false if the queue is disabled or the record is too large
+     */
+    bool push(time_t time, const String& apiPath, const String& body);
+
+    /**
+     * Upload up to maxRecords of the oldest records in a single batch
+     * request, see IotApi::flushBatch(). If the batch request succeeds,
+     * records accepted by the server or rejected with a client error in the
+     * item status are removed from the queue.
+     *
+     * @return the number of records removed from the queue
+     */
+    int drain(size_t maxRecords = 8);
+
+    /// @return the number of queued records
+    uint32_t getCount() const { return _meta.head - _meta.tail; }
+    /// @return the number of bytes of all queued records
+    uint32_t getBytes() const { return _meta.bytes; }
+    /// @return the number of records dropped due to the limits since the queue was created
+    uint32_t getDroppedCount() const { return _meta.dropped; }
+
+
+    // **********************************************************************
+    // P r i v a t e
+    // **********************************************************************
+
+private:
+    struct Meta
+    {
+        uint32_t head;      // sequence number of the next record
+        uint32_t tail;      // sequence number of the oldest record
+        uint32_t bytes;
+        uint32_t dropped;
+        uint32_t slots;     // number of record slots the records are stored in
+    };
+
+    const char * _nvramSection;
+    uint16_t _maxRecords;
+    size_t _maxBytes;
+    uint32_t _maxAge_s;
+    Meta _meta;
+
+    void _recordKey(uint32_t seq, char * key, size_t keyLen) const;
+    void _removeOldest(Preferences& preferences, bool isDropped);
+    void _writeMeta(Preferences& preferences);
+};
+
+extern IotTelemetryQueue telemetryQueue;
@@ -0,0 +1,79 @@
+/**
+ * ESP32 generic firmware (Arduino based)
+ * Copyright (c) 2023 clausgf@github. See LICENSE.md for legal information.
+ */
+
+#pragma once
+
+#include "Arduino.h"
+#include <WiFiClientSecure.h>
+
+// *****************************************************************************
+
+/**
+ * Size of the RTC RAM buffer for the serialized TLS session. Sessions
+ * which do not fit, e.g. because they include a large peer certificate,
+ * are not cached.
+ */
+#ifndef IOT_TLS_SESSION_CACHE_SIZE
+#define IOT_TLS_SESSION_CACHE_SIZE 1536
+#endif
+
+// *****************************************************************************
+
+/**
+ * WiFiClientSecure with TLS session resumption across deep sleep.
+ *
+ * After each successful handshake, the negotiated TLS session (session ID
+ * or session ticket and master secret) is serialized to RTC RAM. The next
+ * connection to the same host and port, e.g. after waking up from deep
+ * sleep, offers this session to the server for an abbreviated handshake.
+ * If the server does not accept the session, a full handshake is performed
+ * on the same connection. If the connection fails, the cached session is
+ * discarded and a regular connection is attempted.
+ *
+ * Resumption is supported for server verification with a CA certificate
+ * or without verification (setInsecure()), optionally with a client
+ * certificate. Other configurations (CA bundle, PSK) connect without
+ * resumption.
+ *
+ * Note that the cached session contains secret key material in RTC RAM.
+ */
+class IotWiFiClientSecure: public WiFiClientSecure
+{
+public:
+    IotWiFiClientSecure();
+
+    using WiFiClientSecure::connect;
+    int connect(const char *host, uint16_t port) override;
+    /**
+     * Connect with a timeout in milliseconds. HTTPClient calls this virtual
+     * ESPLwIPClient::connect(); override makes a core with a different 
+     * signature fail to build instead of silently skipping resumption.
+     */
+    int connect(const char *host, uint16_t port, int32_t timeout) override;
+
+    /**
+     * Discard the cached TLS session, forcing a full handshake on the next connection.
+     */
+    static void clearSessionCache();
+
+    /// @return the number of successful session resumptions since power-on
+    static uint32_t getResumedCount();
+    /// @return the number of full handshakes since power-on
+    static uint32_t getFullHandshakeCount();
+    /// @return the duration of the last TCP connect and TLS handshake in milliseconds
+    unsigned long getLastHandshakeDuration_ms() const { return _lastHandshakeDuration_ms; }
+
+private:
+    unsigned long _lastHandshakeDuration_ms;
+
+    /**
+     * Connect and perform the TLS handshake offering the cached session.
+     * If the server rejects the session, the new session is cached.
+     * @return 1 if connected, 0 otherwise; *oResumed tells whether the
+     *         server accepted the session
+     */
+    int _connectWithSession(const char *host, uint16_t port, int32_t timeout, bool *oResumed);
+    void _saveSession(const char *host, uint16_t port);
+};
@@ -0,0 +1,68 @@
+/**
+ * ESP32 generic firmware (Arduino based)
+ * Copyright (c) 2023 clausgf@github. See LICENSE.md for legal information.
+ */
+
+#pragma once
+
+#include "Arduino.h"
+
+// *****************************************************************************
+
+#ifndef IOT_URL_TEMPLATE_MAX_SEGMENTS
+#define IOT_URL_TEMPLATE_MAX_SEGMENTS 16
+#endif
+
+/**
+ * URL template with variables like "telemetry/{project}/{device}/{kind}".
+ *
+ * The pattern is parsed once into literal and variable segments. render()
+ * writes the URL into a caller-provided buffer without allocating memory,
+ * looking up the variables in a list of name/value pairs. Variables which
+ * are not in the list are written as is, including their braces, so they
+ * can be replaced in a later step.
+ *
+ * Example:
+ *     IotUrlTemplate path("telemetry/{project}/{device}/{kind}");
+ *     const IotUrlTemplate::Variable vars[] = { {"kind", "sensors"} };
+ *     char buf[64];
+ *     path.render(buf, sizeof(buf), vars, 1);   // "telemetry/{project}/{device}/sensors"
+ */
+class IotUrlTemplate
+{
+public:
+    struct Variable
+    {
+        const char * name;
+        const char * value;
+    };
+
+    IotUrlTemplate(const char * pattern = "");
+
+    /// Parse a new pattern; patterns with too many segments are treated as a single literal
+    void parse(const char * pattern);
+    const String& getPattern() const { return _pattern; }
+    /// @return true if the pattern contains variables
+    bool hasVariables() const { return _hasVariables; }
+
+    /**
+     * Render the URL into the buffer, which is always zero terminated.
+     * @return false if the buffer is too small and the URL was truncated
+     */
+    bool render(char * buf, size_t bufLen, const Variable * vars, size_t varCount) const;
+
+private:
+    struct Segment
+    {
+        uint16_t offset;        // variables: offset of the name without braces
+        uint16_t len;
+        bool isVariable;
+    };
+
+    String _pattern;
+    Segment _segments[IOT_URL_TEMPLATE_MAX_SEGMENTS];
+    size_t _segmentCount;
+    bool _hasVariables;
+};
+
+// *****************************************************************************
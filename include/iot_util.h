@@ -5,8 +5,14 @@
 
 #pragma once
 
+#include <functional>
+#include <type_traits>
+
 #include "Arduino.h"
 #include <Preferences.h>
+#include <nvs.h>
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
 
 // *****************************************************************************
 
@@ -16,8 +22,111 @@
 class IotPersistableValue
 {
 public:
+    IotPersistableValue(): _nextDirty(nullptr), _isDirty(false) {}
+    // copies are not marked dirty, only the original is in the list of dirty values
+    IotPersistableValue(const IotPersistableValue&): _nextDirty(nullptr), _isDirty(false) {}
+    IotPersistableValue& operator=(const IotPersistableValue&) { return *this; }
+    /// a dirty value is removed from the list of dirty values, its deferred write is discarded
+    virtual ~IotPersistableValue();
+
     virtual void readFromNvram(Preferences& preferences) = 0;
     virtual void writeToNvram(Preferences& preferences) const = 0;
+
+    /// write all values deferred since the last flush, @see setDeferredPersistentWrites()
+    static void flushDirty();
+
+protected:
+    /// remember the value for writing in flushDirty()
+    void markDirty();
+    virtual const char * getNvramSection() const = 0;
+    /// write the value, joining a transaction for its section
+    virtual void writeDeferred() = 0;
+
+private:
+    IotPersistableValue * _nextDirty;
+    bool _isDirty;
+    static IotPersistableValue * _firstDirty;
+};
+
+// *****************************************************************************
+
+/**
+ * Scope for writing several values to one NVRAM section.
+ * 
+ * The section is opened on the first write and kept open until the
+ * transaction is destroyed, instead of opening it for each value.
+ * Values equal to the stored ones are not written at all, which saves
+ * flash write cycles; this is the main benefit.
+ * 
+ * Note that this is not an atomic transaction: NVS writes each value to
+ * flash immediately, so a reset in the middle leaves the values written
+ * so far. commit() and the destructor call nvs_commit(), which does not
+ * reduce flash wear or latency.
+ * 
+ * While a transaction is alive, other transactions for the same section
+ * join it instead of opening the section again. In particular, assignments
+ * to implicit NVRAM persistent values (@see IotPersistentValue) within the
+ * scope of a transaction are written through the transaction:
+ * 
+ *     {
+ *         IotNvramTransaction transaction("iot-var");
+ *         _value1 = 1;
+ *         _value2 = 2;
+ *     }   // section closed here
+ * 
+ * Transactions are not thread safe; use them from a single task only.
+ */
+class IotNvramTransaction
+{
+public:
+    // disallow copying & assignment
+    IotNvramTransaction(const IotNvramTransaction&) = delete;
+    IotNvramTransaction& operator=(const IotNvramTransaction&) = delete;
+
+    IotNvramTransaction(const char * section);
+    ~IotNvramTransaction();
+
+    /// write the value unless it is already stored, @return false on error
+    bool put(const char * key, int32_t value);
+    bool put(const char * key, int64_t value);
+    /// bools are stored as uint8 like Preferences::putBool() does
+    bool put(const char * key, bool value);
+    bool put(const char * key, const String& value);
+    bool put(const char * key, const char * value) { return put(key, String(value)); }
+    /// write a blob unless it is already stored, like Preferences::putBytes()
+    bool putBytes(const char * key, const void * value, size_t len);
+    /// remove the key if it exists, @return false on error
+    bool remove(const char * key);
+
+    /// call nvs_commit() if values were written; called automatically by the destructor
+    void commit();
+
+    /// @return the number of values written to NVRAM since boot, unchanged values are not counted
+    static uint32_t getWriteCount() { return _writeCount; }
+
+    /**
+     * Set a handler which is called for every value actually written to
+     * (or removed from) NVRAM, e.g. for counting writes per key.
+     * 
+     * @return the previous handler
+     */
+    typedef std::function<void(const char * section, const char * key)> WriteHandler;
+    static WriteHandler setWriteHandler(WriteHandler writeHandler);
+
+private:
+    const char * _section;
+    nvs_handle_t _handle;
+    bool _isOpen;
+    bool _isDirty;
+    IotNvramTransaction * _parent;      // the transaction joined, if any
+    IotNvramTransaction * _next;        // list of all alive transactions
+
+    static IotNvramTransaction * _first;
+    static uint32_t _writeCount;
+    static WriteHandler _writeHandler;
+
+    bool _open();
+    bool _written(esp_err_t err, const char * key);
 };
 
 // *****************************************************************************
@@ -34,6 +143,25 @@ enum PreferedPersistentStorage { IOT_PERSISTENT_PREFER_RTC, IOT_PERSISTENT_PREFE
  * The default is to prefer NVRAM.
  */
 void setPreferedPersistentStorage(PreferedPersistentStorage preferedPersistentStorage);
+PreferedPersistentStorage getPreferedPersistentStorage();
+
+/**
+ * Defer the NVRAM writes of implicit persistent values.
+ * 
+ * If enabled, changes of implicit NVRAM persistent values are only 
+ * remembered in RAM and written by @see flushPersistentValues(), opening
+ * each section once. The IoT system flushes before deep sleep, restart
+ * and shutdown, so a value changed several times during a cycle is 
+ * written at most once. Changes are lost on an unexpected reset,
+ * e.g. by a watchdog or brownout.
+ * 
+ * The default is to write immediately.
+ */
+void setDeferredPersistentWrites(bool isDeferred);
+bool isDeferredPersistentWrites();
+
+/// write all deferred persistent values to NVRAM
+void flushPersistentValues();
 
 // *****************************************************************************
 
@@ -55,7 +183,9 @@ void setPreferedPersistentStorage(PreferedPersistentStorage preferedPersistentSt
  * @see setPreferedPersistentStorage()
  * has to be called before initializing a persistent value
  * using @see begin() if it supports both storage types.
- * On value change, the new values are persisted immediately.
+ * On value change, the new values are persisted immediately, through
+ * an enclosing @see IotNvramTransaction if there is one, or in 
+ * @see flushPersistentValues() if writes are deferred.
  * 
  * The actual storage is:
  * - IOT_STORAGE_RTC: value is stored in RTC RAM
@@ -123,6 +253,10 @@ public:
     IotPersistentValue<T>& operator=(const T& value) { set(value); return *this; }
     operator T() const { return _value; }
 
+protected:
+    virtual const char * getNvramSection() const { return _section; }
+    virtual void writeDeferred();
+
 private:
     enum StorageType _storageType;
     const char * _section;
@@ -133,6 +267,276 @@ private:
 
 // *****************************************************************************
 
+/**
+ * Persistent value for trivially copyable structs, e.g. calibration data
+ * or running averages, stored as a single blob in RTC RAM or NVRAM.
+ * 
+ * The storage types and their selection are the same as for
+ * @see IotPersistentValue. The struct is stored together with a schema
+ * version and a CRC. Stored contents with a different version or a wrong
+ * CRC, e.g. RTC RAM after a brownout or NVRAM written by an older firmware,
+ * are not trusted; the default value is used instead. Increment the 
+ * version whenever the layout of the struct changes.
+ * 
+ * T must not contain padding bytes, e.g. order the members by decreasing
+ * size or add explicit reserved members. set() compares the struct 
+ * bytewise, so undefined padding bytes would let an unchanged value 
+ * appear changed and cause needless writes.
+ * 
+ * For RTC RAM storage, provide an RtcImage in RTC memory:
+ * 
+ *     struct Calibration { float offset; float gain; };
+ *     RTC_DATA_ATTR IotPersistentStruct<Calibration>::RtcImage rtcCalibration;
+ *     IotPersistentStruct<Calibration> calibration("app", "calib", &rtcCalibration, 1, { 0.0, 1.0 });
+ * 
+ * Since T is arbitrary, this class is implemented in the header.
+ */
+template <typename T>
+class IotPersistentStruct: public IotPersistableValue
+{
+    static_assert(std::is_trivially_copyable<T>::value, "IotPersistentStruct requires a trivially copyable type");
+
+public:
+    /// stored representation of the value in RTC RAM and NVRAM
+    struct RtcImage
+    {
+        uint32_t version;
+        uint32_t crc;
+        T value;
+    };
+
+    /// Create a persistent value for RTC RAM storage.
+    IotPersistentStruct(RtcImage * rtcPtr, uint32_t version, const T& defaultValue = T()):
+        IotPersistentStruct(nullptr, nullptr, rtcPtr, version, defaultValue) {}
+
+    /// Create a persistent value for NVRAM storage, @see IotPersistentValue
+    IotPersistentStruct(const char * section, const char * key, uint32_t version, const T& defaultValue = T()):
+        IotPersistentStruct(section, key, nullptr, version, defaultValue) {}
+
+    /// Create a persistent value for RTC RAM or NVRAM depending on @see setPreferedPersistentStorage()
+    IotPersistentStruct(const char * section, const char * key, RtcImage * rtcPtr, uint32_t version, const T& defaultValue = T()):
+        _storageType(IOT_STORAGE_NONE),
+        _section(section),
+        _key(key),
+        _rtcPtr(rtcPtr),
+        _version(version),
+        _value(defaultValue),
+        _isRestored(false)
+    {
+    }
+
+    /// Initialize the value from RTC RAM or implicit NVRAM storage, @see IotPersistentValue::begin()
+    void begin();
+    /// @see begin(), but support RTC RAM and explicit NVRAM storage
+    void begin(Preferences& preferences);
+
+    virtual void readFromNvram(Preferences& preferences);
+    virtual void writeToNvram(Preferences& preferences) const;
+
+    enum StorageType { IOT_STORAGE_NONE, IOT_STORAGE_RTC, IOT_STORAGE_NVRAM_IMPLICIT, IOT_STORAGE_NVRAM_EXPLICIT };
+
+    const T& get() const { return _value; }
+    /// store the value unless it is bytewise equal to the current one, T must not contain padding
+    void set(const T& value);
+
+    /// @return true if the value was restored from storage in begin(), false if the default is used
+    bool isRestored() const { return _isRestored; }
+
+    IotPersistentStruct<T>& operator=(const T& value) { set(value); return *this; }
+    operator T() const { return _value; }
+
+protected:
+    virtual const char * getNvramSection() const { return _section; }
+    virtual void writeDeferred();
+
+private:
+    enum StorageType _storageType;
+    const char * _section;
+    const char * _key;
+    RtcImage * _rtcPtr;
+    uint32_t _version;
+    T _value;
+    bool _isRestored;
+
+    static uint32_t _crc(const RtcImage& image)
+    {
+        uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)&image.version, sizeof(image.version));
+        return esp_rom_crc32_le(crc, (const uint8_t *)&image.value, sizeof(image.value));
+    }
+    void _toImage(RtcImage& image) const
+    {
+        image.version = _version;
+        image.value = _value;
+        image.crc = _crc(image);
+    }
+    bool _fromImage(const RtcImage& image)
+    {
+        if (image.version != _version || image.crc != _crc(image))
+        {
+            return false;
+        }
+        _value = image.value;
+        return true;
+    }
+};
+
+template <typename T>
+void IotPersistentStruct<T>::begin()
+{
+    // prefer RTC RAM by default, correct storage type if NVRAM prefered and supported
+    if (_key != nullptr && (_rtcPtr == nullptr || getPreferedPersistentStorage() == IOT_PERSISTENT_PREFER_NVRAM))
+    {
+        _storageType = (_section != nullptr) ? IOT_STORAGE_NVRAM_IMPLICIT : IOT_STORAGE_NVRAM_EXPLICIT;
+    } else if (_rtcPtr != nullptr) {
+        _storageType = IOT_STORAGE_RTC;
+    } else {
+        _storageType = IOT_STORAGE_NONE;
+    }
+
+    if (_storageType == IOT_STORAGE_RTC)
+    {
+        _isRestored = _fromImage(*_rtcPtr);
+        if (!_isRestored)
+        {
+            log_i("IotPersistentStruct: RTC contents invalid, using default value");
+            _toImage(*_rtcPtr);
+        }
+    } else if (_storageType == IOT_STORAGE_NVRAM_IMPLICIT) {
+        Preferences preferences;
+        preferences.begin(_section, true);
+        readFromNvram(preferences);
+        preferences.end();
+    }
+}
+
+template <typename T>
+void IotPersistentStruct<T>::begin(Preferences& preferences)
+{
+    begin();  // determine storage type, read NVRAM variables
+
+    if (_storageType == IOT_STORAGE_NVRAM_EXPLICIT)
+    {
+        readFromNvram(preferences);
+    }
+}
+
+template <typename T>
+void IotPersistentStruct<T>::readFromNvram(Preferences& preferences)
+{
+    RtcImage image;
+    _isRestored = (preferences.getBytesLength(_key) == sizeof(image)) 
+        && (preferences.getBytes(_key, &image, sizeof(image)) == sizeof(image))
+        && _fromImage(image);
+    if (!_isRestored)
+    {
+        log_i("IotPersistentStruct: NVRAM key '%s' not found or invalid, using default value", _key);
+    }
+}
+
+template <typename T>
+void IotPersistentStruct<T>::writeToNvram(Preferences& preferences) const
+{
+    RtcImage image;
+    _toImage(image);
+    preferences.putBytes(_key, &image, sizeof(image));
+    log_i("IotPersistentStruct: NVRAM key '%s' written", _key);
+}
+
+template <typename T>
+void IotPersistentStruct<T>::set(const T& value)
+{
+    if (memcmp(&value, &_value, sizeof(T)) == 0)
+    {
+        return;
+    }
+
+    _value = value;
+
+    if (_storageType == IOT_STORAGE_RTC)
+    {
+        _toImage(*_rtcPtr);
+    } else if (_storageType == IOT_STORAGE_NVRAM_IMPLICIT && isDeferredPersistentWrites()) {
+        markDirty();
+    } else if (_storageType == IOT_STORAGE_NVRAM_IMPLICIT) {
+        writeDeferred();
+    }
+}
+
+template <typename T>
+void IotPersistentStruct<T>::writeDeferred()
+{
+    // joins a transaction for the section if there is one
+    RtcImage image;
+    _toImage(image);
+    IotNvramTransaction transaction(_section);
+    transaction.putBytes(_key, &image, sizeof(image));
+    log_i("IotPersistentStruct: NVRAM key '%s/%s' updated", _section, _key);
+}
+
+// *****************************************************************************
+
+/**
+ * Wear levelled ring of records in a raw flash partition, for counters
+ * which change on every wake cycle or more often.
+ * 
+ * Each write appends a small record with a sequence number and a CRC
+ * to the ring instead of rewriting a fixed location; a sector is only
+ * erased when the ring wraps around to it. With a partition of n sectors,
+ * each sector is erased once per n * 256 writes. The latest valid record
+ * is found in begin(), so a write interrupted by a power loss falls back
+ * to the previous value.
+ * 
+ * The partition must be declared in the partition table as a data 
+ * partition of at least two sectors, e.g.
+ * 
+ *     counters, data, 0x99, , 0x2000,
+ */
+class IotFlashRing
+{
+public:
+    // disallow copying & assignment
+    IotFlashRing(const IotFlashRing&) = delete;
+    IotFlashRing& operator=(const IotFlashRing&) = delete;
+
+    IotFlashRing(const char * partitionLabel);
+
+    /// find the partition and the latest record, @return false on error
+    bool begin();
+
+    /// @return the latest value written, or the default if the ring is empty
+    int64_t get(int64_t defaultValue = 0) const { return _hasValue ? _value : defaultValue; }
+    /// append the value to the ring, @return false on error
+    bool set(int64_t value);
+
+    /// @return the number of records written since boot
+    uint32_t getWriteCount() const { return _writeCount; }
+    /// @return the number of sectors erased since boot
+    uint32_t getEraseCount() const { return _eraseCount; }
+
+private:
+    struct Record
+    {
+        uint32_t seq;
+        uint32_t crc;
+        int64_t value;
+    };
+
+    const char * _partitionLabel;
+    const esp_partition_t * _partition;
+    size_t _slotCount;
+    size_t _slot;           // slot of the latest record
+    uint32_t _seq;
+    int64_t _value;
+    bool _hasValue;
+    uint32_t _writeCount;
+    uint32_t _eraseCount;
+
+    static uint32_t _crc(const Record& record);
+    bool _isSlotErased(size_t slot);
+};
+
+// *****************************************************************************
+
 bool waitUntil(std::function<bool()> isFinished, unsigned long timeout_ms, 
                const char* logMessage = nullptr);
 
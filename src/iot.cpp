@@ -6,6 +6,7 @@
 #include "iot.h"
 
 #include "cstdio"
+#include <algorithm>
 #include <esp_system.h>
 #include <esp_task_wdt.h>
 #include <esp_sleep.h>
@@ -78,7 +79,8 @@ Iot::Iot() :
     _batteryMin_mV(config, -1, "battery_min_mv", "batMinMv"),
     _panicSleepDurationInit_s(config, 60, "panic_sleep_init_s", "panicSlpInit"),
     _panicSleepDurationFactor(config, 2, "panic_sleep_factor", "panicSlpFac"),
-    _panicSleepDurationMax_s(config, 24 * 60 * 60, "panic_sleep_max_s", "panicSlpMax")
+    _panicSleepDurationMax_s(config, 24 * 60 * 60, "panic_sleep_max_s", "panicSlpMax"),
+    _telemetryFormat(config, "json", "telemetry_format", "tlmFormat")
 {
     // initialize variables
     _deviceId = "";
@@ -93,6 +95,14 @@ Iot::Iot() :
     __ntpServer2 = _ntpServer2.get();
     __ntpServer3 = _ntpServer3.get();
 
+    // apply configuration changes from IotConfig::updateConfig()
+    _logLevel.setChangeHandler([this]() {
+        logger.setLogLevel((IotLogger::LogLevel)_logLevel.get());
+    });
+    _ntpServer1.setChangeHandler([this]() { _applyNtpServers(); });
+    _ntpServer2.setChangeHandler([this]() { _applyNtpServers(); });
+    _ntpServer3.setChangeHandler([this]() { _applyNtpServers(); });
+
     // initialize NVRAM
     esp_err_t err = nvs_flash_init();
     if (err != ESP_OK)
@@ -122,13 +132,16 @@ void Iot::begin()
     setLed(true);  
 
     // initialize persistent variables
-    _bootCount.begin();
-    _activeDuration_ms.begin();
-    _lastSleepDuration_s.begin();
-    _ntpLastSyncTime.begin();
-    _panicSleepDuration_s.begin();
-
-    _bootCount = _bootCount.get() + 1;
+    {
+        IotNvramTransaction transaction("iot-var");
+        _bootCount.begin();
+        _activeDuration_ms.begin();
+        _lastSleepDuration_s.begin();
+        _ntpLastSyncTime.begin();
+        _panicSleepDuration_s.begin();
+
+        _bootCount = _bootCount.get() + 1;
+    }
 
     if (WiFi.status() != WL_CONNECTED)
     {
@@ -145,6 +158,7 @@ void Iot::begin()
     // read configuration again to allow overwriting hardcoded parameters with WiFi config
     config.begin();
     logger.begin((IotLogger::LogLevel)_logLevel.get());
+    _applyNtpServers();
 
     // check the battery voltage
     if (_batteryPin.get() >= 0 && _batteryMin_mV.get() > 0)
@@ -160,7 +174,12 @@ void Iot::begin()
     // initialize other components
     startWatchdog(_watchdogTimeout_s.get());
     api.setDeviceName(getDeviceId());
+    api.setUrlVariable("firmware", getFirmwareVersion());
+    api.setUrlVariable("boot", String(getBootCount()));
     api.begin();
+
+    // upload log lines kept in RTC RAM while WiFi was not available
+    logger.flush();
 }
 
 bool Iot::begin(const char *ssid, const char *password, unsigned long timeout_ms)
@@ -240,19 +259,24 @@ String Iot::getDeviceId()
 // NTP time
 // *****************************************************************************
 
-String Iot::getTimeIso(time_t time)
+const char * Iot::getTimeIso(char * buf, size_t bufLen, time_t time)
 {
     struct tm timeinfo;
     gmtime_r(&time, &timeinfo);
 
-    const int BUFLEN = 32;
-    static char buf[BUFLEN];
-    snprintf(buf, BUFLEN, "%04d-%02d-%02dT%02d:%02d:%02dZ", 
+    snprintf(buf, bufLen, "%04d-%02d-%02dT%02d:%02d:%02dZ", 
         (timeinfo.tm_year + 1900) % 10000, (timeinfo.tm_mon + 1) % 100, timeinfo.tm_mday % 100, 
         timeinfo.tm_hour % 100, timeinfo.tm_min % 100, timeinfo.tm_sec % 100);
     return buf;
 }
 
+String Iot::getTimeIso(time_t time)
+{
+    const int BUFLEN = 32;
+    char buf[BUFLEN];
+    return getTimeIso(buf, BUFLEN, time);
+}
+
 String Iot::getTimeIso()
 {
     time_t now = time(nullptr);
@@ -269,18 +293,44 @@ void Iot::setNtp(int resyncInterval_s, int timeout_ms,
     _ntpServer1 = ntpServer1;
     _ntpServer2 = ntpServer2;
     _ntpServer3 = ntpServer3;
+    _applyNtpServers();
+}
+
+void Iot::_applyNtpServers()
+{
+    // a running SNTP client keeps pointers to the server names, so stop it
+    // before the strings are replaced and restart it with the new names
+    bool isRunning = esp_sntp_enabled();
+    if (isRunning)
+    {
+        esp_sntp_stop();
+    }
+
     __ntpServer1 = _ntpServer1.get();
     __ntpServer2 = _ntpServer2.get();
     __ntpServer3 = _ntpServer3.get();
+
+    if (isRunning)
+    {
+        esp_sntp_setservername(0, __ntpServer1.c_str());
+        esp_sntp_setservername(1, __ntpServer2.isEmpty() ? nullptr : __ntpServer2.c_str());
+        esp_sntp_setservername(2, __ntpServer3.isEmpty() ? nullptr : __ntpServer3.c_str());
+        esp_sntp_init();
+        log_i("NTP servers updated: %s %s %s", __ntpServer1.c_str(), __ntpServer2.c_str(), __ntpServer3.c_str());
+    }
 }
 
 // *****************************************************************************
 
 bool Iot::isTimePlausible()
+{
+    return isTimePlausible(time(nullptr));
+}
+
+bool Iot::isTimePlausible(time_t time)
 {
     time_t implausibleTimeThreshold = 50 * 365 * 24 * 3600l;
-    time_t now = time(nullptr);
-    return (now > implausibleTimeThreshold);
+    return (time > implausibleTimeThreshold);
 }
 
 // bool Iot::waitUntilTimePlausible(unsigned long timeout_ms)
@@ -367,32 +417,131 @@ bool Iot::syncNtpTime()
 // API
 // *****************************************************************************
 
+const String& Iot::_getTelemetryPath(const char * kind, const String& apiPath)
+{
+    // cache the path for the last kind, other variables are replaced by the API
+    if (_telemetryPathKind != kind || _telemetryPathPattern != apiPath)
+    {
+        IotUrlTemplate urlTemplate(apiPath.c_str());
+        const IotUrlTemplate::Variable vars[] = { { "kind", kind } };
+        char buf[IOT_API_MAX_URL_LEN];
+        if (!urlTemplate.render(buf, sizeof(buf), vars, 1))
+        {
+            log_e("Telemetry path %s exceeds IOT_API_MAX_URL_LEN", apiPath.c_str());
+        }
+        _telemetryPathKind = kind;
+        _telemetryPathPattern = apiPath;
+        _telemetryPath = buf;
+    }
+    return _telemetryPath;
+}
+
 int Iot::postTelemetry(String kind, String jsonData, String apiPath)
 {
-    apiPath.replace("{kind}", kind);
     // other variables are replaced in apiPost()
-    String oResult = "";
-    return api.apiPost(oResult, apiPath, jsonData);
+    return _postTelemetry(_getTelemetryPath(kind.c_str(), apiPath), (const uint8_t *)jsonData.c_str(), jsonData.length());
+}
+
+int Iot::postTelemetry(const char * kind, const IotJsonWriter& json, String apiPath)
+{
+    if (json.isOverflow())
+    {
+        log_e("Telemetry kind=%s not posted, JSON buffer too small", kind);
+        return HTTPC_ERROR_TOO_LESS_RAM;
+    }
+    return _postTelemetry(_getTelemetryPath(kind, apiPath), (const uint8_t *)json.c_str(), json.length());
+}
+
+int Iot::postTelemetry(const char * kind, const IotCborWriter& cbor, String apiPath)
+{
+    if (cbor.isOverflow())
+    {
+        log_e("Telemetry kind=%s not posted, CBOR buffer too small", kind);
+        return HTTPC_ERROR_TOO_LESS_RAM;
+    }
+    // binary data can neither be batched nor queued, post it right away
+    return api.apiPost(_getTelemetryPath(kind, apiPath), cbor.data(), cbor.length(), {{"Content-Type", "application/cbor"}});
+}
+
+int Iot::_postTelemetry(const String& apiPath, const uint8_t * body, size_t bodyLen)
+{
+    if (api.isBatching())
+    {
+        return api.addToBatch("telemetry", apiPath, String((const char *)body, bodyLen));
+    }
+
+    // queue the data right away if there is no chance to post it
+    if (telemetryQueue.isEnabled() && WiFi.status() != WL_CONNECTED)
+    {
+        telemetryQueue.push(time(nullptr), apiPath, String((const char *)body, bodyLen));
+        return HTTP_CODE_ACCEPTED;
+    }
+
+    int httpStatusCode = api.apiPost(apiPath, body, bodyLen);
+    if (telemetryQueue.isEnabled())
+    {
+        if (httpStatusCode < 0 || httpStatusCode >= 500)
+        {
+            telemetryQueue.push(time(nullptr), apiPath, String((const char *)body, bodyLen));
+        } else if (httpStatusCode >= 200 && httpStatusCode < 300) {
+            telemetryQueue.drain();
+        }
+    }
+    return httpStatusCode;
 }
 
 // *****************************************************************************
 
-int Iot::postSystemTelemetry(String kind, String apiPath)
+template <typename Writer>
+void Iot::_writeSystemTelemetry(Writer& writer)
 {
-    String jsonData = String("{") 
-        + "\"battery_V\":" + String(getBatteryVoltage_mV()/1000.0, 2)
-        + ",\"wifi_rssi\":" + WiFi.RSSI() 
-        + ",\"boot_count\":" + getBootCount() 
-        + ",\"active_ms\":" + getActiveDuration_ms() 
-        + ",\"lastSleep_s\":" + getLastSleepDuration_s()
-        + ",\"panicSleep_s\":" + getPanicSleepDuration_s()
-        + ",\"time\":\"" + getTimeIso() + "\""
-        + ",\"firmware_version\":\"" + getFirmwareVersion() + "\""
-        + ",\"firmware_sha256\":\"" + getFirmwareSha256() + "\""
-        + "}";
-    return postTelemetry(kind, jsonData, apiPath);
+    char timeIso[32];
+    writer.beginObject()
+        .field("battery_V", getBatteryVoltage_mV()/1000.0, 2)
+        .field("wifi_rssi", WiFi.RSSI())
+        .field("boot_count", getBootCount())
+        .field("active_ms", getActiveDuration_ms())
+        .field("lastSleep_s", getLastSleepDuration_s())
+        .field("panicSleep_s", getPanicSleepDuration_s())
+        .field("time", getTimeIso(timeIso, sizeof(timeIso), time(nullptr)))
+        .field("firmware_version", getFirmwareVersion())
+        .field("firmware_sha256", getFirmwareSha256())
+        .endObject();
 }
 
+int Iot::postSystemTelemetry(String kind, String apiPath)
+{
+    // CBOR can neither be batched nor queued, so JSON is used if the data
+    // will be batched or queued right away, see _postTelemetry()
+    bool isOffline = telemetryQueue.isEnabled() && WiFi.status() != WL_CONNECTED;
+    int httpStatusCode = 0;
+    if (_telemetryFormat.get() == "cbor" && !api.isBatching() && !isOffline)
+    {
+        uint8_t cborBuf[384];
+        IotCborWriter cbor(cborBuf, sizeof(cborBuf));
+        _writeSystemTelemetry(cbor);
+        httpStatusCode = postTelemetry(kind.c_str(), cbor, apiPath);
+        if (telemetryQueue.isEnabled() && httpStatusCode >= 200 && httpStatusCode < 300)
+        {
+            telemetryQueue.drain();
+        }
+        if (!telemetryQueue.isEnabled() || (httpStatusCode >= 0 && httpStatusCode < 500))
+        {
+            return httpStatusCode;
+        }
+        // fall through to queue the data as JSON
+    }
+
+    char buf[512];
+    IotJsonWriter json(buf, sizeof(buf));
+    _writeSystemTelemetry(json);
+    if (httpStatusCode != 0 && !json.isOverflow())
+    {
+        telemetryQueue.push(time(nullptr), _getTelemetryPath(kind.c_str(), apiPath), json.c_str());
+        return httpStatusCode;
+    }
+    return postTelemetry(kind.c_str(), json, apiPath);
+}
 
 // **********************************************************************
 // Led
@@ -516,7 +665,7 @@ void Iot::escalatingSleepPanicHandler()
 // System management: firmware
 // *****************************************************************************
 
-String Iot::getFirmwareVersion()
+const String& Iot::getFirmwareVersion()
 {
     if (_firmwareVersion.isEmpty())
     {
@@ -537,7 +686,7 @@ String Iot::getFirmwareVersion()
     return _firmwareVersion;
 }
 
-String Iot::getFirmwareSha256()
+const String& Iot::getFirmwareSha256()
 {
     if (_firmwareSha256.isEmpty())
     {
@@ -558,6 +707,68 @@ String Iot::getFirmwareSha256()
 }
 
 
+// *****************************************************************************
+// System management: updates
+// *****************************************************************************
+
+void Iot::addSyncFile(String apiPath, String localPath, fs::FS& fs)
+{
+    _syncFiles.push_back({ apiPath, localPath, &fs });
+}
+
+bool Iot::updateAll(String firmwareApiPath, String manifestApiPath)
+{
+    // known ETags of all resources
+    std::map<String, String> etags;
+    const char * configApiPath = config.getApiPath();
+    if (configApiPath != nullptr)
+    {
+        etags[configApiPath] = config.getConfigHttpEtag();
+    }
+    for (auto const& file : _syncFiles)
+    {
+        etags[file.apiPath] = api.getFileHttpEtag(file.localPath.c_str(), *file.fs);
+    }
+    etags[firmwareApiPath] = api.getFirmwareHttpEtag();
+
+    std::vector<String> stalePaths;
+    int httpStatusCode = api.apiCheckForUpdates(etags, stalePaths, manifestApiPath);
+    if ((httpStatusCode < 200 || httpStatusCode >= 300) && httpStatusCode != HTTP_CODE_NOT_MODIFIED)
+    {
+        // e.g. no manifest endpoint, check all resources individually
+        log_i("Manifest not available status=%d, checking %u resources individually", httpStatusCode, etags.size());
+        for (auto const& kv : etags)
+        {
+            stalePaths.push_back(kv.first);
+        }
+    }
+    auto isStale = [&stalePaths](const String& apiPath)
+    {
+        return std::find(stalePaths.begin(), stalePaths.end(), apiPath) != stalePaths.end();
+    };
+
+    // fetch the stale resources, the firmware last
+    bool isUpdated = false;
+    if (configApiPath != nullptr && isStale(configApiPath))
+    {
+        isUpdated = config.updateConfig() || isUpdated;
+    }
+    for (auto const& file : _syncFiles)
+    {
+        if (isStale(file.apiPath))
+        {
+            int fileStatusCode = api.syncFile(file.apiPath, file.localPath.c_str(), *file.fs);
+            isUpdated = isUpdated || (fileStatusCode == HTTP_CODE_OK || fileStatusCode == HTTP_CODE_PARTIAL_CONTENT);
+        }
+    }
+    if (isStale(firmwareApiPath))
+    {
+        resetWatchdog();
+        isUpdated = api.updateFirmware(firmwareApiPath) || isUpdated;
+    }
+    return isUpdated;
+}
+
 // *****************************************************************************
 // System management: watchdog
 // *****************************************************************************
@@ -632,14 +843,23 @@ void Iot::deepSleep()
 
 void Iot::deepSleep(int sleep_duration_s, bool panic)
 {
-    if (!panic)
     {
-        _panicSleepDuration_s = -1; // regular shutdown, reset panic sleep duration
-    }
+        // persist all values, including deferred ones, in a single NVRAM transaction
+        IotNvramTransaction transaction("iot-var");
+        if (!panic)
+        {
+            _panicSleepDuration_s = -1; // regular shutdown, reset panic sleep duration
+        }
 
-    _lastSleepDuration_s = sleep_duration_s;
-    _activeDuration_ms = millis();
-    log_w("Active for %lld ms, going to deep sleep for %d s", getActiveDuration_ms(), sleep_duration_s);
+        _lastSleepDuration_s = sleep_duration_s;
+        _activeDuration_ms = millis();
+        flushPersistentValues();
+    }
+    logger.flush(true);
+    api.flushBatch();
+    api.disconnect();
+    log_w("Active for %lld ms, going to deep sleep for %d s, NVRAM writes=%u", getActiveDuration_ms(), sleep_duration_s,
+        IotNvramTransaction::getWriteCount());
     delay(10);  // delay to allow log to be written
     setLed(false);
     _deepSleepHandler(sleep_duration_s);
@@ -649,13 +869,21 @@ void Iot::deepSleep(int sleep_duration_s, bool panic)
 
 void Iot::restart(bool panic)
 {
-    if (!panic)
     {
-        _panicSleepDuration_s = -1; // regular shutdown, reset panic sleep duration
-    }
+        // persist all values, including deferred ones, in a single NVRAM transaction
+        IotNvramTransaction transaction("iot-var");
+        if (!panic)
+        {
+            _panicSleepDuration_s = -1; // regular shutdown, reset panic sleep duration
+        }
 
-    _lastSleepDuration_s = 0;
-    _activeDuration_ms = millis();
+        _lastSleepDuration_s = 0;
+        _activeDuration_ms = millis();
+        flushPersistentValues();
+    }
+    logger.flush(true);
+    api.flushBatch();
+    api.disconnect();
     log_w("Active for %lld ms, restarting", getActiveDuration_ms());
     delay(10);  // delay to allow log to be written
     setLed(false);
@@ -666,13 +894,21 @@ void Iot::restart(bool panic)
 
 void Iot::shutdown(bool panic)
 {
-    if (!panic)
     {
-        _panicSleepDuration_s = -1; // regular shutdown, reset panic sleep duration
-    }
+        // persist all values, including deferred ones, in a single NVRAM transaction
+        IotNvramTransaction transaction("iot-var");
+        if (!panic)
+        {
+            _panicSleepDuration_s = -1; // regular shutdown, reset panic sleep duration
+        }
 
-    _lastSleepDuration_s = 0;
-    _activeDuration_ms = millis();
+        _lastSleepDuration_s = 0;
+        _activeDuration_ms = millis();
+        flushPersistentValues();
+    }
+    logger.flush(true);
+    api.flushBatch();
+    api.disconnect();
     log_w("Active for %lld ms, shutting down", getActiveDuration_ms());
     delay(10);  // delay to allow log to be written
     setLed(false);
@@ -5,6 +5,7 @@
 
 #include "iot_api.h"
 
+#include <algorithm>
 #include <esp_ota_ops.h>
 #include <WiFi.h>
 #include <Preferences.h>
@@ -29,10 +30,21 @@ IotApi::IotApi()
     _deviceName = "";
     _provisioningToken = "";
     _deviceToken = "";
+    _firmwareEtag = "";
+    _firmwareDate = "";
+    _mergeRequestHeader();
 
     _wifiClientSecurePtr = nullptr;
     _wifiClientPtr = nullptr;
     _httpClientPtr = nullptr;
+
+    _isBatching = false;
+    _batchMaxBytes = 0;
+    _batchBytes = 0;
+
+    _requestCount = 0;
+    _reusedCount = 0;
+    _handshakeCount = 0;
 }
 
 void IotApi::begin()
@@ -44,11 +56,15 @@ void IotApi::begin()
     // log_d("provisioningToken=%s", _provisioningToken.c_str());
     _deviceToken = preferences.getString(_nvram_device_token_key, "");
     // log_d("deviceToken=%s", _deviceToken.c_str());
+    _firmwareEtag = preferences.getString(_nvram_firmware_etag_key, "");
+    _firmwareDate = preferences.getString(_nvram_firmware_date_key, "");
     preferences.end();
+    _mergeRequestHeader();
 }
 
 void IotApi::end()
 {
+    disconnect();
 }
 
 
@@ -61,8 +77,8 @@ WiFiClient * IotApi::_getWiFiClientPtr()
     {
         if (_baseUrl.startsWith("https://"))
         {
-            log_d("Create WiFiClientSecure");
-            _wifiClientSecurePtr = new WiFiClientSecure();
+            log_d("Create IotWiFiClientSecure");
+            _wifiClientSecurePtr = new IotWiFiClientSecure();
             _wifiClientPtr = _wifiClientSecurePtr;
         } else {
             log_d("Create WiFiClient");
@@ -107,6 +123,29 @@ HTTPClient & IotApi::_getHttpClient()
 }
 
 
+// *****************************************************************************
+
+void IotApi::disconnect()
+{
+    if (_httpClientPtr != nullptr && _wifiClientPtr != nullptr && _wifiClientPtr->connected())
+    {
+        log_d("Closing kept connection");
+        _wifiClientPtr->stop();
+    }
+    if (_requestCount > 0)
+    {
+        log_i("HTTP connection stats: requests=%u handshakes=%u reused=%u (%d%%) tls_resumed=%u tls_full=%u",
+            _requestCount, _handshakeCount, _reusedCount, (int)(100 * getConnectionReuseRatio()),
+            IotWiFiClientSecure::getResumedCount(), IotWiFiClientSecure::getFullHandshakeCount());
+    }
+}
+
+float IotApi::getConnectionReuseRatio() const
+{
+    return (_requestCount == 0) ? 0.0f : (float)_reusedCount / _requestCount;
+}
+
+
 // *****************************************************************************
 // API configuration
 // *****************************************************************************
@@ -118,21 +157,36 @@ void IotApi::setApiUrl(String apiBaseurl)
     {
         _baseUrl += "/";
     }
+    _urlCache.clear();
 }
 
 void IotApi::setProjectName(String project)
 {
     _projectName = project;
+    _urlCache.clear();
 }
 
 void IotApi::setDeviceName(String device)
 {
     _deviceName = device;
+    _urlCache.clear();
+}
+
+void IotApi::setUrlVariable(const char * name, String value)
+{
+    if (_urlVariables.size() >= IOT_API_MAX_URL_VARIABLES && _urlVariables.find(name) == _urlVariables.end())
+    {
+        log_e("URL variable %s not set, IOT_API_MAX_URL_VARIABLES exceeded", name);
+        return;
+    }
+    _urlVariables[name] = value;
+    _urlCache.clear();
 }
 
 void IotApi::setApiHeader(std::map<String, String> header)
 {
     _defaultRequestHeader = header;
+    _mergeRequestHeader();
 }
 
 void IotApi::setCACert(const char *server_certificate)
@@ -211,6 +265,7 @@ void IotApi::setDeviceToken(String deviceToken)
         return;
     }
     _deviceToken = deviceToken;
+    _mergeRequestHeader();
 
     Preferences preferences;
     preferences.begin("iot", false);
@@ -275,43 +330,113 @@ bool IotApi::updateProvisioningOk(String apiPath)
 // HTTP requests
 // *****************************************************************************
 
+String IotApi::_renderUrl(const char * path)
+{
+    IotUrlTemplate urlTemplate(path);
+    IotUrlTemplate::Variable vars[IOT_API_MAX_URL_VARIABLES + 2] = {
+        { "project", _projectName.c_str() },
+        { "device", _deviceName.c_str() }
+    };
+    size_t varCount = 2;
+    for (auto const& kv : _urlVariables)
+    {
+        vars[varCount++] = { kv.first.c_str(), kv.second.c_str() };
+    }
+
+    // render into a stack buffer, which fits most URLs
+    char buf[IOT_API_MAX_URL_LEN];
+    if (urlTemplate.render(buf, sizeof(buf), vars, varCount))
+    {
+        return buf;
+    }
+
+    // otherwise render into a heap buffer for the longest possible URL
+    size_t maxValueLen = 0;
+    for (size_t i = 0; i < varCount; i++)
+    {
+        maxValueLen = std::max(maxValueLen, strlen(vars[i].value));
+    }
+    size_t bufLen = strlen(path) + IOT_URL_TEMPLATE_MAX_SEGMENTS * maxValueLen + 1;
+    log_d("URL for path %s exceeds IOT_API_MAX_URL_LEN, allocating %u bytes", path, bufLen);
+    char * heapBuf = new char[bufLen];
+    if (heapBuf == nullptr)
+    {
+        log_e("URL for path %s not rendered, out of memory", path);
+        return "";
+    }
+    urlTemplate.render(heapBuf, bufLen, vars, varCount);
+    String url = heapBuf;
+    delete[] heapBuf;
+    return url;
+}
+
 String IotApi::_replaceVars(String str)
 {
-    String ret = str;
-    ret.replace("{device}", _deviceName);
-    ret.replace("{project}", _projectName);
-    return ret;
+    return _renderUrl(str.c_str());
 }
 
 String IotApi::getApiUrlForPath(String path)
 {
-    if (path.startsWith("/"))
+    auto it = _urlCache.find(path);
+    if (it != _urlCache.end())
+    {
+        return it->second;
+    }
+
+    // variables like {project} may be used in the base URL as well
+    String url = _renderUrl((_baseUrl + (path.startsWith("/") ? path.substring(1) : path)).c_str());
+    if (url.isEmpty())
     {
-        path = path.substring(1);
+        return url;
     }
-    return _replaceVars(_baseUrl + path);
+    if (_urlCache.size() >= IOT_API_URL_CACHE_SIZE)
+    {
+        _urlCache.clear();
+    }
+    _urlCache[path] = url;
+    return url;
 }
 
 // *****************************************************************************
 
-void IotApi::_addRequestHeader(HTTPClient& http, std::map<String, String> &header)
+void IotApi::_mergeRequestHeader()
 {
-    // start with default header, then merge base header, then merge request header
+    // start with default header, then merge base header
     std::map<String, String> h = {
         { "Accept", "application/json" },
         { "Content-Type", "application/json" },
         { "Authorization", _deviceToken }
     };
     for (auto const& kv : _defaultRequestHeader) { h[kv.first] = kv.second; }
-    for (auto const& kv : header) { h[kv.first] = kv.second; }
- 
-    // write headers to HTTPClient
+
+    _mergedRequestHeader.clear();
     for (auto const& kv : h)
     {
-        if ( !kv.second.isEmpty() )
+        if (!kv.second.isEmpty())
+        {
+            _mergedRequestHeader.push_back(kv);
+        }
+    }
+}
+
+void IotApi::_addRequestHeader(HTTPClient& http, std::map<String, String> &header)
+{
+    // the merged header does not contain duplicates, so HTTPClient need 
+    // not search for headers to replace; the request header overrides it
+    for (auto const& kv : _mergedRequestHeader)
+    {
+        if (header.empty() || header.find(kv.first) == header.end())
         {
             log_d("  HTTP header: %s=%s", kv.first.c_str(), kv.second.c_str());
-            http.addHeader(kv.first.c_str(), kv.second.c_str());
+            http.addHeader(kv.first, kv.second, false, false);
+        }
+    }
+    for (auto const& kv : header)
+    {
+        if (!kv.second.isEmpty())
+        {
+            log_d("  HTTP header: %s=%s", kv.first.c_str(), kv.second.c_str());
+            http.addHeader(kv.first, kv.second, false, false);
         }
     }
 }
@@ -320,6 +445,144 @@ void IotApi::_addRequestHeader(HTTPClient& http, std::map<String, String> &heade
 
 int IotApi::apiRequest(String& oResponse, std::map<String, String>& oResponseHeader, const char * requestType, String apiPath, String requestBody, std::map<String, String> requestHeader, const char* collectResponseHeaderKeys[], const size_t collectResponseHeaderKeysCount)
 {
+    return apiRequest(oResponse, oResponseHeader, requestType, apiPath, 
+        (const uint8_t *)requestBody.c_str(), requestBody.length(), requestHeader,
+        collectResponseHeaderKeys, collectResponseHeaderKeysCount);
+}
+
+int IotApi::apiRequest(String& oResponse, std::map<String, String>& oResponseHeader, const char * requestType, String apiPath, const uint8_t * requestBody, size_t requestBodyLen, std::map<String, String> requestHeader, const char* collectResponseHeaderKeys[], const size_t collectResponseHeaderKeysCount)
+{
+    return _apiRequest(&oResponse, nullptr, oResponseHeader, requestType, apiPath, 
+        requestBody, requestBodyLen, nullptr, requestHeader, collectResponseHeaderKeys, collectResponseHeaderKeysCount);
+}
+
+int IotApi::apiRequest(Stream& oResponseStream, std::map<String, String>& oResponseHeader, const char * requestType, String apiPath, const uint8_t * requestBody, size_t requestBodyLen, std::map<String, String> requestHeader, const char* collectResponseHeaderKeys[], const size_t collectResponseHeaderKeysCount)
+{
+    return _apiRequest(nullptr, &oResponseStream, oResponseHeader, requestType, apiPath, 
+        requestBody, requestBodyLen, nullptr, requestHeader, collectResponseHeaderKeys, collectResponseHeaderKeysCount);
+}
+
+// *****************************************************************************
+
+/**
+ * Stream adapter sending the output of a body producer with chunked 
+ * transfer encoding, i.e. each part is preceded by its length in hex
+ * and the body ends with a part of length zero.
+ * 
+ * HTTPClient::sendRequest(type, stream, 0) sends the stream until
+ * available() returns -1.
+ */
+class IotChunkedBodyStream: public Stream
+{
+public:
+    IotChunkedBodyStream(IotBodyProducer producer): 
+        _producer(producer), _pos(0), _len(0), _isLastChunk(false) {}
+
+    virtual int available() { _fill(); return (_pos < _len) ? (int)(_len - _pos) : -1; }
+    virtual int read() { _fill(); return (_pos < _len) ? _buf[_pos++] : -1; }
+    virtual int peek() { _fill(); return (_pos < _len) ? _buf[_pos] : -1; }
+    virtual size_t readBytes(char * buffer, size_t length)
+    {
+        _fill();
+        size_t n = std::min(length, _len - _pos);
+        memcpy(buffer, _buf + _pos, n);
+        _pos += n;
+        return n;
+    }
+    virtual size_t write(uint8_t c) { return 0; }
+    virtual void flush() {}
+
+private:
+    static const size_t _headerLen = 6;     // up to 4 hex digits and CRLF
+    IotBodyProducer _producer;
+    uint8_t _buf[_headerLen + IOT_API_CHUNK_SIZE + 4];
+    size_t _pos;
+    size_t _len;
+    bool _isLastChunk;
+
+    void _fill()
+    {
+        if (_pos < _len || _isLastChunk)
+        {
+            return;
+        }
+        size_t n = _producer ? _producer(_buf + _headerLen, IOT_API_CHUNK_SIZE) : 0;
+        if (n > IOT_API_CHUNK_SIZE)
+        {
+            n = IOT_API_CHUNK_SIZE;
+        }
+        // the header is written right aligned in front of the data
+        char header[_headerLen + 1];
+        size_t headerLen = snprintf(header, sizeof(header), "%x\r\n", (unsigned int)n);
+        _pos = _headerLen - headerLen;
+        memcpy(_buf + _pos, header, headerLen);
+        _len = _headerLen + n;
+        if (n == 0)
+        {
+            // the last chunk is followed by an empty trailer
+            _isLastChunk = true;
+        }
+        _buf[_len++] = '\r';
+        _buf[_len++] = '\n';
+    }
+};
+
+/**
+ * Stream adapter passing received data to a body sink; without a sink, 
+ * the data is discarded.
+ */
+class IotBodySinkStream: public Stream
+{
+public:
+    IotBodySinkStream(IotBodySink sink): _sink(sink) {}
+
+    virtual size_t write(uint8_t c) { return write(&c, 1); }
+    virtual size_t write(const uint8_t * buf, size_t size) { return (!_sink || _sink(buf, size)) ? size : 0; }
+    virtual int available() { return 0; }
+    virtual int read() { return -1; }
+    virtual int peek() { return -1; }
+    virtual void flush() {}
+
+private:
+    IotBodySink _sink;
+};
+
+int IotApi::apiRequest(Stream& oResponseStream, std::map<String, String>& oResponseHeader, const char * requestType, String apiPath, Stream& requestBodyStream, size_t requestBodyLen, std::map<String, String> requestHeader, const char* collectResponseHeaderKeys[], const size_t collectResponseHeaderKeysCount)
+{
+    if (requestBodyLen > 0)
+    {
+        return _apiRequest(nullptr, &oResponseStream, oResponseHeader, requestType, apiPath, 
+            nullptr, requestBodyLen, &requestBodyStream, requestHeader, collectResponseHeaderKeys, collectResponseHeaderKeysCount);
+    }
+
+    // unknown length: send the stream in chunks
+    IotChunkedBodyStream chunkedStream([&requestBodyStream](uint8_t * buf, size_t len)
+    {
+        return requestBodyStream.readBytes((char *)buf, len);
+    });
+    requestHeader["Transfer-Encoding"] = "chunked";
+    return _apiRequest(nullptr, &oResponseStream, oResponseHeader, requestType, apiPath, 
+        nullptr, 0, &chunkedStream, requestHeader, collectResponseHeaderKeys, collectResponseHeaderKeysCount);
+}
+
+int IotApi::apiRequest(IotBodySink responseSink, std::map<String, String>& oResponseHeader, const char * requestType, String apiPath, IotBodyProducer requestBodyProducer, std::map<String, String> requestHeader, const char* collectResponseHeaderKeys[], const size_t collectResponseHeaderKeysCount)
+{
+    IotBodySinkStream sinkStream(responseSink);
+    if (!requestBodyProducer)
+    {
+        return _apiRequest(nullptr, &sinkStream, oResponseHeader, requestType, apiPath, 
+            nullptr, 0, nullptr, requestHeader, collectResponseHeaderKeys, collectResponseHeaderKeysCount);
+    }
+    IotChunkedBodyStream chunkedStream(requestBodyProducer);
+    requestHeader["Transfer-Encoding"] = "chunked";
+    return _apiRequest(nullptr, &sinkStream, oResponseHeader, requestType, apiPath, 
+        nullptr, 0, &chunkedStream, requestHeader, collectResponseHeaderKeys, collectResponseHeaderKeysCount);
+}
+
+int IotApi::_apiRequest(String * oResponse, Stream * oResponseStream, std::map<String, String>& oResponseHeader, const char * requestType, String apiPath, const uint8_t * requestBody, size_t requestBodyLen, Stream * requestBodyStream, std::map<String, String> requestHeader, const char* collectResponseHeaderKeys[], const size_t collectResponseHeaderKeysCount)
+{
+    String localResponse = "";
+    String& response = (oResponse != nullptr) ? *oResponse : localResponse;
     String url = getApiUrlForPath(apiPath);
     log_i("HTTP %s url=%s", requestType, url.c_str());
 
@@ -330,8 +593,30 @@ int IotApi::apiRequest(String& oResponse, std::map<String, String>& oResponseHea
         _getHttpClient().collectHeaders(collectResponseHeaderKeys, collectResponseHeaderKeysCount);
     }
 
-    // execute HTTP request
-    int httpStatusCode = _getHttpClient().sendRequest(requestType, (uint8_t*)requestBody.c_str(), requestBody.length());
+    // execute HTTP request, reusing the keep-alive connection if still open
+    bool isReused = _getHttpClient().connected();
+    _requestCount++;
+    if (isReused) { _reusedCount++; } else { _handshakeCount++; }
+    auto sendRequest = [&]()
+    {
+        return (requestBodyStream != nullptr)
+            ? _getHttpClient().sendRequest(requestType, requestBodyStream, requestBodyLen)
+            : _getHttpClient().sendRequest(requestType, (uint8_t*)requestBody, requestBodyLen);
+    };
+    int httpStatusCode = sendRequest();
+    // if sending the header failed, the server did not get the request; a lost
+    // connection is detected after the request was sent, so only idempotent
+    // requests are retried then, e.g. a POST could be processed twice
+    bool isIdempotent = (strcasecmp("GET", requestType) == 0) || (strcasecmp("HEAD", requestType) == 0);
+    if (isReused && (httpStatusCode == HTTPC_ERROR_SEND_HEADER_FAILED 
+        || (httpStatusCode == HTTPC_ERROR_CONNECTION_LOST && isIdempotent && requestBodyStream == nullptr)))
+    {
+        // the server closed the idle connection, retry once on a new one
+        log_d("HTTP %s url=%s -> kept connection was closed, reconnecting", requestType, url.c_str());
+        _reusedCount--;
+        _handshakeCount++;
+        httpStatusCode = sendRequest();
+    }
     for (int i=0; i<collectResponseHeaderKeysCount; i++)
     {
         const char * key = collectResponseHeaderKeys[i];
@@ -342,11 +627,19 @@ int IotApi::apiRequest(String& oResponse, std::map<String, String>& oResponseHea
     }
     //log_i("  HTTP response status: %d", httpStatusCode);
     //log_i("  HTTP response size: %d", getHttpClient().getSize());
-    if ((strcasecmp("HEAD", requestType) != 0) && httpStatusCode != 304)
+    if ((strcasecmp("HEAD", requestType) == 0) || httpStatusCode == 304)
     {
-        oResponse = _getHttpClient().getString();
+        response = "";
+    } else if (oResponseStream != nullptr && httpStatusCode >= 200 && httpStatusCode < 300) {
+        // stream successful responses, error responses are read for logging
+        response = "";
+        int written = _getHttpClient().writeToStream(oResponseStream);
+        if (written < 0)
+        {
+            httpStatusCode = written;
+        }
     } else {
-        oResponse = "";
+        response = _getHttpClient().getString();
     }
 
     // evaluate HTTP response
@@ -359,8 +652,9 @@ int IotApi::apiRequest(String& oResponse, std::map<String, String>& oResponseHea
                 requestType, url.c_str(), httpStatusCode);
             clearDeviceToken();
     } else if (httpStatusCode < 200 || httpStatusCode >= 400) {
-        log_e("HTTP %s url=%s requestBody=%s -> status=%d responseBody=%s", 
-            requestType, url.c_str(), requestBody.c_str(), httpStatusCode, oResponse.c_str());
+        log_e("HTTP %s url=%s requestBody=%.*s -> status=%d responseBody=%s", 
+            requestType, url.c_str(), (requestBody != nullptr) ? (int)requestBodyLen : 8, 
+            (requestBody != nullptr) ? (const char *)requestBody : "(stream)", httpStatusCode, response.c_str());
     } else {
         log_i("HTTP %s url=%s -> status=%d", requestType, url.c_str(), httpStatusCode);
     }
@@ -394,6 +688,20 @@ int IotApi::apiPost(String& response, String apiPath, String body, std::map<Stri
     return apiRequest(response, responseHeader, "POST", apiPath, body, header);
 }
 
+int IotApi::apiPost(String& response, String apiPath, const uint8_t * body, size_t bodyLen, std::map<String, String> header)
+{
+    std::map<String, String> responseHeader;
+    return apiRequest(response, responseHeader, "POST", apiPath, body, bodyLen, header);
+}
+
+int IotApi::apiPost(String apiPath, const uint8_t * body, size_t bodyLen, std::map<String, String> header)
+{
+    IotBodySinkStream discardStream(nullptr);
+    std::map<String, String> responseHeader;
+    return _apiRequest(nullptr, &discardStream, responseHeader, "POST", apiPath, 
+        body, bodyLen, nullptr, header, nullptr, 0);
+}
+
 // *****************************************************************************
 
 bool IotApi::apiCheckForUpdate(String apiPath, const char *nvram_etag_key, const char *nvram_date_key)
@@ -417,6 +725,61 @@ bool IotApi::apiCheckForUpdate(String apiPath, const char *nvram_etag_key, const
 
 // *****************************************************************************
 
+int IotApi::apiCheckForUpdates(const std::map<String, String>& etags, std::vector<String>& oStalePaths, String apiPath)
+{
+    oStalePaths.clear();
+
+    // the server knows the paths with variables replaced
+    std::map<String, String> pathsByUrlPath;
+    size_t capacity = JSON_OBJECT_SIZE(etags.size());
+    for (auto const& kv : etags)
+    {
+        String urlPath = _replaceVars(kv.first);
+        capacity += urlPath.length() + kv.second.length() + 2;
+        pathsByUrlPath[urlPath] = kv.first;
+    }
+    DynamicJsonDocument requestDoc(capacity);
+    for (auto const& kv : etags)
+    {
+        requestDoc[_replaceVars(kv.first)] = kv.second;
+    }
+    String request;
+    serializeJson(requestDoc, request);
+
+    String response;
+    int httpStatusCode = apiPost(response, apiPath, request);
+    if (httpStatusCode == HTTP_CODE_NOT_MODIFIED || httpStatusCode == HTTP_CODE_NO_CONTENT)
+    {
+        log_i("Manifest: all %u resources current", etags.size());
+        return httpStatusCode;
+    }
+    if (httpStatusCode < 200 || httpStatusCode >= 300)
+    {
+        return httpStatusCode;
+    }
+
+    // parse the array of stale paths
+    DynamicJsonDocument responseDoc(JSON_ARRAY_SIZE(etags.size()) + response.length() + 64);
+    DeserializationError error = deserializeJson(responseDoc, response);
+    if (error || !responseDoc.is<JsonArray>())
+    {
+        log_e("Manifest: invalid response, expected an array of paths");
+        return HTTPC_ERROR_NO_HTTP_SERVER;
+    }
+    for (JsonVariant item : responseDoc.as<JsonArray>())
+    {
+        auto it = pathsByUrlPath.find(item.as<String>());
+        if (it != pathsByUrlPath.end())
+        {
+            oStalePaths.push_back(it->second);
+        }
+    }
+    log_i("Manifest: %u of %u resources stale", oStalePaths.size(), etags.size());
+    return httpStatusCode;
+}
+
+// *****************************************************************************
+
 void IotApi::apiSetConnectionTimeout(int32_t timeout){
     _getHttpClient().setConnectTimeout(timeout);
 }
@@ -427,46 +790,224 @@ void IotApi::apiSetRequestTimeout(uint16_t timeout){
     _getHttpClient().setTimeout(timeout);
 }
 
+// *****************************************************************************
+// Batch requests
+// *****************************************************************************
+
+/**
+ * Validate a JSON document and re-encode it on a single line.
+ * @return false if the document is not valid JSON
+ */
+static bool minifyJson(const String& json, String& oJson)
+{
+    DynamicJsonDocument doc(4 * json.length() + 256);
+    DeserializationError err = deserializeJson(doc, json);
+    if (err)
+    {
+        log_w("Batch item body is not valid JSON, error=%s", err.c_str());
+        return false;
+    }
+    oJson = "";
+    serializeJson(doc, oJson);
+    return true;
+}
+
+/**
+ * Append a batch item as a JSON line.
+ * @param jsonBody the re-encoded body if it is embedded as a JSON value,
+ *        empty to embed body as a JSON string
+ * @return false if bufLen is too small for the line
+ */
+static bool appendBatchLine(String& oBody, size_t bufLen, const char * kind, const String& path,
+    time_t time, const String& contentType, const String& body, const String& jsonBody)
+{
+    char * buf = new char[bufLen];
+    if (buf == nullptr)
+    {
+        return false;
+    }
+    char timeIso[32];
+    IotJsonWriter json(buf, bufLen);
+    json.beginObject()
+        .field("kind", kind)
+        .field("path", path);
+    if (time != 0)
+    {
+        json.field("time", iot.getTimeIso(timeIso, sizeof(timeIso), time));
+    }
+    json.field("contentType", contentType).key("body");
+    if (!jsonBody.isEmpty())
+    {
+        json.rawValue(jsonBody.c_str());
+    } else {
+        json.value(body);
+    }
+    json.endObject();
+
+    bool success = !json.isOverflow();
+    if (success)
+    {
+        oBody += json.c_str();
+        oBody += '\n';
+    }
+    delete[] buf;
+    return success;
+}
+
+void IotApi::beginBatch(size_t maxBytes)
+{
+    _isBatching = true;
+    _batchMaxBytes = maxBytes;
+}
+
+int IotApi::addToBatch(const char * kind, String apiPath, const String& body, const char * contentType, time_t time)
+{
+    if (!_isBatching)
+    {
+        String response;
+        return apiPost(response, apiPath, body, {{"Content-Type", contentType}});
+    }
+
+    if (apiPath.startsWith("/"))
+    {
+        apiPath = apiPath.substring(1);
+    }
+    size_t itemBytes = strlen(kind) + apiPath.length() + strlen(contentType) + body.length() + 64;
+    if (!_batchItems.empty() && _batchBytes + itemBytes > _batchMaxBytes)
+    {
+        log_d("Batch budget exceeded, flushing %u items", _batchItems.size());
+        size_t maxBytes = _batchMaxBytes;
+        flushBatch();
+        beginBatch(maxBytes);
+    }
+
+    _batchItems.push_back({ kind, _replaceVars(apiPath), contentType, body, time });
+    _batchBytes += itemBytes;
+    return HTTP_CODE_ACCEPTED;
+}
+
+int IotApi::flushBatch(std::vector<int> * oItemStatus, String apiPath)
+{
+    _isBatching = false;
+    if (_batchItems.empty())
+    {
+        return 0;
+    }
+    std::vector<BatchItem> items;
+    items.swap(_batchItems);
+
+    // build JSON lines body, JSON bodies are validated and re-encoded on a single line;
+    // items which cannot be added keep a local error status
+    String body;
+    body.reserve(_batchBytes);
+    _batchBytes = 0;
+    std::vector<int> itemStatus(items.size(), HTTPC_ERROR_TOO_LESS_RAM);
+    std::vector<size_t> postedItems;   // index in items of each line in body
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        const BatchItem& item = items[i];
+        String jsonBody;
+        if (item.contentType.startsWith("application/json") && !item.body.isEmpty())
+        {
+            minifyJson(item.body, jsonBody);
+        }
+        // most lines fit into twice their size, escaping may need up to six times
+        size_t len = strlen(item.kind) + item.path.length() + item.contentType.length() + item.body.length();
+        if (!appendBatchLine(body, 2 * len + jsonBody.length() + 128, item.kind, item.path, item.time, item.contentType, item.body, jsonBody)
+            && !appendBatchLine(body, 6 * len + jsonBody.length() + 128, item.kind, item.path, item.time, item.contentType, item.body, jsonBody))
+        {
+            log_e("Batch item path=%s not added, out of memory", item.path.c_str());
+        } else {
+            postedItems.push_back(i);
+        }
+    }
+
+    int httpStatusCode = HTTPC_ERROR_TOO_LESS_RAM;
+    if (!postedItems.empty())
+    {
+        String response;
+        httpStatusCode = apiPost(response, apiPath, body, {{"Content-Type", "application/x-ndjson"}});
+        log_i("Batch of %u items posted -> status=%d", postedItems.size(), httpStatusCode);
+
+        // evaluate per item status, the status array refers to the posted lines
+        for (size_t i : postedItems)
+        {
+            itemStatus[i] = httpStatusCode;
+        }
+        if (httpStatusCode >= 200 && httpStatusCode < 300)
+        {
+            DynamicJsonDocument doc(1024 + 32 * postedItems.size());
+            if (!deserializeJson(doc, response) && doc.is<JsonArray>())
+            {
+                JsonArray statusArray = doc.as<JsonArray>();
+                for (size_t j = 0; j < postedItems.size() && j < statusArray.size(); j++)
+                {
+                    JsonVariant status = statusArray[j];
+                    itemStatus[postedItems[j]] = status.is<int>() ? status.as<int>() : (status["status"] | httpStatusCode);
+                }
+            }
+        }
+    }
+
+    if (oItemStatus != nullptr)
+    {
+        oItemStatus->swap(itemStatus);
+        return httpStatusCode;
+    }
+
+    // nobody evaluates the item status, keep items which may be posted later
+    String logLines;
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        const BatchItem& item = items[i];
+        if (itemStatus[i] >= 0 && itemStatus[i] < 500)
+        {
+            continue;
+        }
+        if (strcmp(item.kind, "telemetry") == 0 && telemetryQueue.isEnabled())
+        {
+            telemetryQueue.push(item.time != 0 ? item.time : time(nullptr), item.path, item.body);
+        } else if (strcmp(item.kind, "log") == 0) {
+            logLines += item.body;
+            logLines += '\n';
+        } else {
+            log_w("Batch item kind=%s path=%s lost, status=%d", item.kind, item.path.c_str(), itemStatus[i]);
+        }
+    }
+    if (!logLines.isEmpty())
+    {
+        logger.persistToJournal(logLines.c_str());
+    }
+    return httpStatusCode;
+}
+
+
 // *****************************************************************************
 // Firmware
 // *****************************************************************************
 
 String IotApi::getFirmwareHttpEtag()
 {
-    return config.getConfigString(_nvram_firmware_etag_key, "");
+    return _firmwareEtag;
 }
 
 String IotApi::getFirmwareHttpDate()
 {
-    return config.getConfigString(_nvram_firmware_date_key, "");
+    return _firmwareDate;
 }
 
 // *****************************************************************************
 
 bool IotApi::updateFirmware(String apiPath, std::map<String, String> header)
 {
-    // get etag and date from preferences
-    Preferences preferences;
-    preferences.begin("iot", true);
-    String etag = preferences.getString(_nvram_firmware_etag_key, "");
-    String date = preferences.getString(_nvram_firmware_date_key, "");
-    preferences.end();
-
-    // prepare header
-    std::map<String, String> h = {
-        { "If-None-Match", etag },
-        { "If-Modified-Since", date },
-        { "Authorization", _deviceToken }
-    };
-    for (auto const& kv : _defaultRequestHeader) { h[kv.first] = kv.second; }
-    for (auto const& kv : header) { h[kv.first] = kv.second; }
-    std::map<std::string, std::string> hh;
-    for (auto const& kv : h) { hh[kv.first.c_str()] = kv.second.c_str(); }
+    // prepare header, the merged default header is added by apiRequest()
+    header.insert({ "If-None-Match", _firmwareEtag });
+    header.insert({ "If-Modified-Since", _firmwareDate });
 
     // HEAD request to check if update is available
     String response = "";
     std::map<String, String> responseHeader;
-    int httpStatusCode = apiRequest(response, responseHeader, "HEAD", apiPath, "", h);
+    int httpStatusCode = apiRequest(response, responseHeader, "HEAD", apiPath, "", header);
 
     // return if no update available
     if (httpStatusCode != 200)
@@ -475,6 +1016,16 @@ bool IotApi::updateFirmware(String apiPath, std::map<String, String> header)
         return false;
     }
 
+    // the OTA client uses its own connection; free the TLS context of the kept one first
+    disconnect();
+    _handshakeCount++;
+
+    // the OTA client needs all headers, but not the JSON content type defaults
+    std::map<std::string, std::string> hh;
+    hh["Authorization"] = _deviceToken.c_str();
+    for (auto const& kv : _defaultRequestHeader) { hh[kv.first.c_str()] = kv.second.c_str(); }
+    for (auto const& kv : header) { hh[kv.first.c_str()] = kv.second.c_str(); }
+
     String url = getApiUrlForPath(apiPath);
     // ota.setTimeout(10000); is the default
     std::string newEtag;
@@ -488,6 +1039,8 @@ bool IotApi::updateFirmware(String apiPath, std::map<String, String> header)
         preferences.putString(_nvram_firmware_etag_key, newEtag.c_str());
         preferences.putString(_nvram_firmware_date_key, newDate.c_str());
         preferences.end();
+        _firmwareEtag = newEtag.c_str();
+        _firmwareDate = newDate.c_str();
         log_i("Firmware update successful");
     } else {
         log_e("Firmware update failed");
@@ -496,3 +1049,186 @@ bool IotApi::updateFirmware(String apiPath, std::map<String, String> header)
 }
 
 // *****************************************************************************
+// Files
+// *****************************************************************************
+
+// Manifest of a synchronized file, stored as text lines next to the file
+struct IotFileManifest
+{
+    String etag;
+    String date;
+    String partEtag;        // ETag of a partially downloaded file
+};
+
+static IotFileManifest readFileManifest(fs::FS& fs, const String& metaPath)
+{
+    IotFileManifest manifest;
+    File file = fs.open(metaPath, FILE_READ);
+    if (file)
+    {
+        manifest.etag = file.readStringUntil('\n');
+        manifest.date = file.readStringUntil('\n');
+        manifest.partEtag = file.readStringUntil('\n');
+        file.close();
+    }
+    return manifest;
+}
+
+static void writeFileManifest(fs::FS& fs, const String& metaPath, const IotFileManifest& manifest)
+{
+    File file = fs.open(metaPath, FILE_WRITE);
+    if (!file)
+    {
+        log_e("File manifest %s not written", metaPath.c_str());
+        return;
+    }
+    file.print(manifest.etag + "\n" + manifest.date + "\n" + manifest.partEtag + "\n");
+    file.close();
+}
+
+/**
+ * @return the first byte position of a Content-Range header like
+ *         "bytes 1000-1999/2000", or -1 if it is not valid
+ */
+static long contentRangeStart(const String& contentRange)
+{
+    const int start = 6;
+    int dash = contentRange.indexOf('-', start);
+    if (!contentRange.startsWith("bytes ") || dash <= start)
+    {
+        return -1;
+    }
+    for (int i = start; i < dash; i++)
+    {
+        if (!isDigit(contentRange[i]))
+        {
+            return -1;
+        }
+    }
+    return contentRange.substring(start, dash).toInt();
+}
+
+String IotApi::getFileHttpEtag(const char * localPath, fs::FS& fs)
+{
+    if (!fs.exists(localPath))
+    {
+        return "";
+    }
+    return readFileManifest(fs, String(localPath) + ".meta").etag;
+}
+
+int IotApi::syncFile(String apiPath, const char * localPath, fs::FS& fs)
+{
+    String metaPath = String(localPath) + ".meta";
+    String partPath = String(localPath) + ".part";
+    IotFileManifest manifest = readFileManifest(fs, metaPath);
+
+    // conditional request for an existing file, resume a partial download
+    std::map<String, String> requestHeader;
+    if (fs.exists(localPath))
+    {
+        requestHeader["If-None-Match"] = manifest.etag;
+        requestHeader["If-Modified-Since"] = manifest.date;
+    }
+    size_t partSize = 0;
+    if (!manifest.partEtag.isEmpty() && fs.exists(partPath))
+    {
+        File file = fs.open(partPath, FILE_READ);
+        partSize = file.size();
+        file.close();
+    }
+    if (partSize > 0)
+    {
+        requestHeader["Range"] = "bytes=" + String(partSize) + "-";
+        requestHeader["If-Range"] = manifest.partEtag;
+        log_i("File %s resuming download at %u bytes", localPath, partSize);
+    }
+
+    // stream the body into the part file; the sink is called after the
+    // response header was received, so the response decides whether the
+    // part file is continued or started again
+    std::map<String, String> responseHeader;
+    const char * collectResponseHeaderKeys[] = { "ETag", "Last-Modified", "Content-Range" };
+    File partFile;
+    bool isPartFileOpened = false;
+    auto openPartFile = [&]()
+    {
+        isPartFileOpened = true;
+        long rangeStart = -1;
+        auto contentRange = responseHeader.find("Content-Range");
+        if (contentRange != responseHeader.end())
+        {
+            rangeStart = contentRangeStart(contentRange->second);
+        }
+        bool isResumed = (rangeStart > 0 && (size_t)rangeStart == partSize);
+        if (rangeStart > 0 && !isResumed)
+        {
+            // the range does not continue the part file, start again on the next call
+            log_w("File %s range mismatch, expected %u got %s", localPath, partSize, contentRange->second.c_str());
+            fs.remove(partPath);
+            manifest.partEtag = "";
+            writeFileManifest(fs, metaPath, manifest);
+            return false;
+        }
+        manifest.partEtag = responseHeader["ETag"];
+        writeFileManifest(fs, metaPath, manifest);
+        partFile = fs.open(partPath, isResumed ? FILE_APPEND : FILE_WRITE);
+        if (!partFile)
+        {
+            log_e("File %s not opened for writing", partPath.c_str());
+        }
+        return (bool)partFile;
+    };
+    int httpStatusCode = apiRequest([&](const uint8_t * data, size_t len)
+    {
+        if (!isPartFileOpened && !openPartFile())
+        {
+            return false;
+        }
+        return partFile && (partFile.write(data, len) == len);
+    }, responseHeader, "GET", apiPath, nullptr, requestHeader, collectResponseHeaderKeys, 3);
+    if (httpStatusCode >= 200 && httpStatusCode < 300 && !isPartFileOpened)
+    {
+        // empty body
+        openPartFile();
+    }
+    if (partFile)
+    {
+        partFile.close();
+    }
+
+    if (httpStatusCode == HTTP_CODE_NOT_MODIFIED)
+    {
+        log_i("File %s not modified", localPath);
+        return httpStatusCode;
+    }
+    if (httpStatusCode == HTTP_CODE_RANGE_NOT_SATISFIABLE)
+    {
+        // the partial download is useless, start again on the next call
+        fs.remove(partPath);
+        manifest.partEtag = "";
+        writeFileManifest(fs, metaPath, manifest);
+        return httpStatusCode;
+    }
+    if (httpStatusCode < 200 || httpStatusCode >= 300)
+    {
+        // a partial download is kept for resuming
+        log_e("File %s not synchronized status=%d", localPath, httpStatusCode);
+        return httpStatusCode;
+    }
+
+    // replace the local file, LittleFS replaces an existing file atomically
+    if (!fs.rename(partPath, localPath) && !(fs.remove(localPath) && fs.rename(partPath, localPath)))
+    {
+        log_e("File %s not renamed to %s", partPath.c_str(), localPath);
+        return HTTPC_ERROR_STREAM_WRITE;
+    }
+    manifest.etag = responseHeader["ETag"];
+    manifest.date = responseHeader["Last-Modified"];
+    manifest.partEtag = "";
+    writeFileManifest(fs, metaPath, manifest);
+    log_i("File %s updated etag=%s", localPath, manifest.etag.c_str());
+    return httpStatusCode;
+}
+
+// *****************************************************************************
@@ -0,0 +1,209 @@
+/**
+ * ESP32 generic firmware (Arduino based)
+ * Copyright (c) 2023 clausgf@github. See LICENSE.md for legal information.
+ */
+
+#include "iot_cbor.h"
+
+#include <cmath>
+
+// *****************************************************************************
+
+// major types
+#define IOT_CBOR_UINT 0
+#define IOT_CBOR_NINT 1
+#define IOT_CBOR_TEXT 3
+#define IOT_CBOR_ARRAY 4
+#define IOT_CBOR_MAP 5
+#define IOT_CBOR_SIMPLE 7
+
+// initial bytes of simple values and indefinite length items
+#define IOT_CBOR_FALSE 0xf4
+#define IOT_CBOR_TRUE 0xf5
+#define IOT_CBOR_NULL 0xf6
+#define IOT_CBOR_FLOAT32 0xfa
+#define IOT_CBOR_FLOAT64 0xfb
+#define IOT_CBOR_BREAK 0xff
+#define IOT_CBOR_INDEFINITE 31
+
+// *****************************************************************************
+
+IotCborWriter::IotCborWriter(uint8_t * buf, size_t bufLen):
+    _buf(buf),
+    _bufLen(bufLen)
+{
+    clear();
+}
+
+void IotCborWriter::clear()
+{
+    _len = 0;
+    _isOverflow = (_buf == nullptr || _bufLen == 0);
+}
+
+// *****************************************************************************
+
+void IotCborWriter::_append(uint8_t b)
+{
+    if (_len + 1 > _bufLen)
+    {
+        _isOverflow = true;
+        return;
+    }
+    _buf[_len++] = b;
+}
+
+void IotCborWriter::_append(const uint8_t * data, size_t len)
+{
+    if (_len + len > _bufLen)
+    {
+        _isOverflow = true;
+        return;
+    }
+    memcpy(_buf + _len, data, len);
+    _len += len;
+}
+
+void IotCborWriter::_appendHead(uint8_t majorType, uint64_t arg)
+{
+    uint8_t head[9];
+    size_t n;
+    if (arg < 24)
+    {
+        head[0] = (majorType << 5) | arg;
+        n = 1;
+    } else if (arg <= 0xff) {
+        head[0] = (majorType << 5) | 24;
+        n = 2;
+    } else if (arg <= 0xffff) {
+        head[0] = (majorType << 5) | 25;
+        n = 3;
+    } else if (arg <= 0xffffffffull) {
+        head[0] = (majorType << 5) | 26;
+        n = 5;
+    } else {
+        head[0] = (majorType << 5) | 27;
+        n = 9;
+    }
+    // argument in network byte order
+    for (size_t i = n - 1; i > 0; i--)
+    {
+        head[i] = arg & 0xff;
+        arg >>= 8;
+    }
+    _append(head, n);
+}
+
+// *****************************************************************************
+
+IotCborWriter& IotCborWriter::beginObject()
+{
+    _append((IOT_CBOR_MAP << 5) | IOT_CBOR_INDEFINITE);
+    return *this;
+}
+
+IotCborWriter& IotCborWriter::endObject()
+{
+    _append(IOT_CBOR_BREAK);
+    return *this;
+}
+
+IotCborWriter& IotCborWriter::beginArray()
+{
+    _append((IOT_CBOR_ARRAY << 5) | IOT_CBOR_INDEFINITE);
+    return *this;
+}
+
+IotCborWriter& IotCborWriter::endArray()
+{
+    _append(IOT_CBOR_BREAK);
+    return *this;
+}
+
+IotCborWriter& IotCborWriter::key(const char * name)
+{
+    return value(name);
+}
+
+// *****************************************************************************
+
+IotCborWriter& IotCborWriter::value(long long v)
+{
+    if (v < 0)
+    {
+        // negative integers are encoded as -1 - n
+        _appendHead(IOT_CBOR_NINT, (uint64_t)(-(v + 1)));
+    } else {
+        _appendHead(IOT_CBOR_UINT, (uint64_t)v);
+    }
+    return *this;
+}
+
+IotCborWriter& IotCborWriter::value(unsigned long long v)
+{
+    _appendHead(IOT_CBOR_UINT, v);
+    return *this;
+}
+
+IotCborWriter& IotCborWriter::value(double v, int decimals)
+{
+    if (std::isnan(v) || std::isinf(v))
+    {
+        return valueNull();
+    }
+    double scale = pow(10.0, decimals);
+    double rounded = round(v * scale) / scale;
+    float rounded32 = (float)rounded;
+    if (std::isfinite(rounded32) && fabs((double)rounded32 - rounded) < 0.5 / scale)
+    {
+        uint32_t bits;
+        memcpy(&bits, &rounded32, sizeof(bits));
+        uint8_t item[5] = { IOT_CBOR_FLOAT32, 
+            (uint8_t)(bits >> 24), (uint8_t)(bits >> 16), (uint8_t)(bits >> 8), (uint8_t)bits };
+        _append(item, sizeof(item));
+    } else {
+        uint64_t bits;
+        memcpy(&bits, &rounded, sizeof(bits));
+        uint8_t item[9];
+        item[0] = IOT_CBOR_FLOAT64;
+        for (int i = 8; i > 0; i--)
+        {
+            item[i] = bits & 0xff;
+            bits >>= 8;
+        }
+        _append(item, sizeof(item));
+    }
+    return *this;
+}
+
+IotCborWriter& IotCborWriter::value(bool v)
+{
+    _append(v ? IOT_CBOR_TRUE : IOT_CBOR_FALSE);
+    return *this;
+}
+
+IotCborWriter& IotCborWriter::value(const char * v)
+{
+    if (v == nullptr)
+    {
+        return valueNull();
+    }
+    size_t len = strlen(v);
+    _appendHead(IOT_CBOR_TEXT, len);
+    _append((const uint8_t *)v, len);
+    return *this;
+}
+
+IotCborWriter& IotCborWriter::valueNull()
+{
+    _append(IOT_CBOR_NULL);
+    return *this;
+}
+
+IotCborWriter& IotCborWriter::rawValue(const uint8_t * cbor, size_t len)
+{
+    _append(cbor, len);
+    return *this;
+}
+
+// *****************************************************************************
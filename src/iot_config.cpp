@@ -6,19 +6,28 @@
 #include "iot_config.h"
 
 #include <map>
+#include <algorithm>
 #include <nvs_flash.h>
-#include <ArduinoJson.h>
+#include <esp_idf_version.h>
+#include <mbedtls/base64.h>
+#include <esp_rom_crc.h>
 
 #include "iot_logger.h"
 #include "iot_api.h"
+#include "iot_util.h"
+#include "iot_json.h"
 
 // *****************************************************************************
 
 IotConfig config;
 
 template class IotConfigValue<int32_t>;
+template class IotConfigValue<int64_t>;
 template class IotConfigValue<bool>;
+template class IotConfigValue<float>;
+template class IotConfigValue<double>;
 template class IotConfigValue<String>;
+template class IotConfigValue<IotBlob>;
 
 
 // *****************************************************************************
@@ -32,14 +41,24 @@ IotConfigValue<T>::IotConfigValue(IotConfig& config, T value, const char *key):
 }
 
 template <typename T>
-IotConfigValue<T>::IotConfigValue(IotConfig& config, T value, const char *config_key, const char *nvram_key)
+IotConfigValue<T>::IotConfigValue(IotConfig& config, T value, const char *config_key, const char *nvram_key):
+    IotPersistableConfigValue(IotConfigTypeOf<T>::type)
 {
     _config_key = config_key;
     _nvram_key = nvram_key;
     _value = value;
+    _defaultValue = value;
     config.registerConfigValuePtr(_config_key, this);
 }
 
+template <typename T>
+std::function<void()> IotConfigValue<T>::setChangeHandler(std::function<void()> changeHandler)
+{
+    std::function<void()> oldChangeHandler = _changeHandler;
+    _changeHandler = changeHandler;
+    return oldChangeHandler;
+}
+
 // *****************************************************************************
 
 template <>
@@ -48,39 +67,145 @@ void IotConfigValue<int32_t>::readFromNvram(Preferences& preferences)
     _value = preferences.getInt(_nvram_key, _value);
 }
 
+template <>
+void IotConfigValue<int64_t>::readFromNvram(Preferences& preferences)
+{
+    _value = preferences.getLong64(_nvram_key, _value);
+}
+
 template <>
 void IotConfigValue<bool>::readFromNvram(Preferences& preferences)
 {
     _value = preferences.getBool(_nvram_key, _value);
 }
 
+template <>
+void IotConfigValue<float>::readFromNvram(Preferences& preferences)
+{
+    _value = preferences.getFloat(_nvram_key, _value);
+}
+
+template <>
+void IotConfigValue<double>::readFromNvram(Preferences& preferences)
+{
+    _value = preferences.getDouble(_nvram_key, _value);
+}
+
 template <>
 void IotConfigValue<String>::readFromNvram(Preferences& preferences)
 {
     _value = preferences.getString(_nvram_key, _value);
 }
 
-template <> bool IotConfigValue<int32_t>::isInt32() const { return true; }
-template <> bool IotConfigValue<int32_t>::isBool() const { return false; }
-template <> bool IotConfigValue<int32_t>::isString() const { return false; }
-template <> bool IotConfigValue<bool>::isInt32() const { return false; }
-template <> bool IotConfigValue<bool>::isBool() const { return true; }
-template <> bool IotConfigValue<bool>::isString() const { return false; }
-template <> bool IotConfigValue<String>::isInt32() const { return false; }
-template <> bool IotConfigValue<String>::isBool() const { return false; }
-template <> bool IotConfigValue<String>::isString() const { return true; }
+template <>
+void IotConfigValue<IotBlob>::readFromNvram(Preferences& preferences)
+{
+    size_t len = preferences.getBytesLength(_nvram_key);
+    if (len == 0)
+    {
+        resetToDefault();
+        return;
+    }
+    _value.resize(len);
+    preferences.getBytes(_nvram_key, _value.data(), len);
+}
+
+// *****************************************************************************
+
+template <>
+void IotConfigValue<int32_t>::readFromSnapshot(nvs_type_t type, const uint8_t * data, size_t len)
+{
+    if (type == NVS_TYPE_I32 && len == sizeof(_value)) { memcpy(&_value, data, len); }
+}
+
+template <>
+void IotConfigValue<int64_t>::readFromSnapshot(nvs_type_t type, const uint8_t * data, size_t len)
+{
+    if (type == NVS_TYPE_I64 && len == sizeof(_value)) { memcpy(&_value, data, len); }
+}
+
+template <>
+void IotConfigValue<bool>::readFromSnapshot(nvs_type_t type, const uint8_t * data, size_t len)
+{
+    if (type == NVS_TYPE_U8 && len == 1) { _value = (data[0] == 1); }
+}
+
+template <>
+void IotConfigValue<float>::readFromSnapshot(nvs_type_t type, const uint8_t * data, size_t len)
+{
+    if (type == NVS_TYPE_BLOB && len == sizeof(_value)) { memcpy(&_value, data, len); }
+}
+
+template <>
+void IotConfigValue<double>::readFromSnapshot(nvs_type_t type, const uint8_t * data, size_t len)
+{
+    if (type == NVS_TYPE_BLOB && len == sizeof(_value)) { memcpy(&_value, data, len); }
+}
+
+template <>
+void IotConfigValue<String>::readFromSnapshot(nvs_type_t type, const uint8_t * data, size_t len)
+{
+    // strings are stored including the terminating zero
+    if (type == NVS_TYPE_STR && len > 0 && data[len - 1] == '\0') { _value = (const char *)data; }
+}
+
+template <>
+void IotConfigValue<IotBlob>::readFromSnapshot(nvs_type_t type, const uint8_t * data, size_t len)
+{
+    if (type == NVS_TYPE_BLOB && len > 0) { _value.assign(data, data + len); }
+}
 
 
 // *****************************************************************************
 // Config
 // *****************************************************************************
 
+#define IOT_CONFIG_SNAPSHOT_MAGIC 0x49435331  // "ICS1"
+#define IOT_CONFIG_SNAPSHOT_SECTION_LEN 16
+
+// Snapshot of the configuration section in RTC RAM, a sequence of records:
+// - 1 byte: NVS type
+// - 1 byte: key length, followed by the key
+// - 2 bytes: data length, followed by the data as stored in NVS
+struct IotConfigSnapshot
+{
+    uint32_t magic;
+    uint32_t crc;
+    char section[IOT_CONFIG_SNAPSHOT_SECTION_LEN];
+    uint16_t len;
+    uint8_t data[IOT_CONFIG_RTC_SNAPSHOT_SIZE];
+};
+
+RTC_DATA_ATTR static IotConfigSnapshot rtcConfigSnapshot;
+
+static uint32_t snapshotCrc()
+{
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)rtcConfigSnapshot.section, sizeof(rtcConfigSnapshot.section));
+    return esp_rom_crc32_le(crc, rtcConfigSnapshot.data, rtcConfigSnapshot.len);
+}
+
+static bool isSnapshotValid(const char * section)
+{
+    return rtcConfigSnapshot.magic == IOT_CONFIG_SNAPSHOT_MAGIC
+        && rtcConfigSnapshot.len <= IOT_CONFIG_RTC_SNAPSHOT_SIZE
+        && strncmp(rtcConfigSnapshot.section, section, IOT_CONFIG_SNAPSHOT_SECTION_LEN) == 0
+        && rtcConfigSnapshot.crc == snapshotCrc();
+}
+
+static void invalidateSnapshot()
+{
+    rtcConfigSnapshot.magic = 0;
+}
+
+
 IotConfig::IotConfig():
     _apiPath(nullptr),
     _nvramSection(nullptr),
     _nvramEtagKey(nullptr),
     _nvramDateKey(nullptr),
-    _configMap()
+    _configValueCount(0),
+    _isCacheLoaded(false),
+    _cache()
 {
 }
 
@@ -91,13 +216,229 @@ void IotConfig::begin(const char * apiPath, const char * nvramSection,
     _nvramSection = nvramSection;
     _nvramEtagKey = nvram_etag_key;
     _nvramDateKey = nvram_date_key;
-    readConfigFromPreferences();
-    log_i("--- Config section=%s etag=%s date=%s", 
-        _nvramSection, getConfigHttpEtag().c_str(), getConfigHttpDate().c_str());
+
+    // after deep sleep, the configuration is usually unchanged and can be
+    // restored from RTC RAM without reading NVRAM
+    bool isSnapshotUsed = (getResetReason() == ESP_RST_DEEPSLEEP) && _loadFromSnapshot();
+    if (!isSnapshotUsed)
+    {
+        _loadCache();
+        readConfigFromPreferences();
+    }
+    log_i("--- Config section=%s etag=%s date=%s source=%s", 
+        _nvramSection, getConfigHttpEtag().c_str(), getConfigHttpDate().c_str(), 
+        isSnapshotUsed ? "RTC" : "NVRAM");
 }
 
 void IotConfig::end()
 {
+    _isCacheLoaded = false;
+    _cache.clear();
+}
+
+// *****************************************************************************
+
+void IotConfig::_loadCache()
+{
+    _isCacheLoaded = false;
+    _cache.clear();
+
+    // rebuild the snapshot while loading the cache
+    invalidateSnapshot();
+    bool isSnapshotComplete = (strlen(_nvramSection) < IOT_CONFIG_SNAPSHOT_SECTION_LEN);
+    rtcConfigSnapshot.len = 0;
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(_nvramSection, NVS_READONLY, &handle);
+    if (err == ESP_ERR_NVS_NOT_FOUND)
+    {
+        // the section does not exist yet, i.e. it is empty
+        _isCacheLoaded = true;
+        _saveSnapshot(isSnapshotComplete);
+        return;
+    } else if (err != ESP_OK) {
+        log_e("Config cache not loaded section=%s: %s", _nvramSection, esp_err_to_name(err));
+        return;
+    }
+
+    nvs_entry_info_t info;
+#if ESP_IDF_VERSION_MAJOR >= 5
+    nvs_iterator_t it = nullptr;
+    err = nvs_entry_find(NVS_DEFAULT_PART_NAME, _nvramSection, NVS_TYPE_ANY, &it);
+    while (err == ESP_OK)
+    {
+        nvs_entry_info(it, &info);
+        isSnapshotComplete = _loadCacheEntry(handle, info) && isSnapshotComplete;
+        err = nvs_entry_next(&it);
+    }
+    nvs_release_iterator(it);
+#else
+    nvs_iterator_t it = nvs_entry_find(NVS_DEFAULT_PART_NAME, _nvramSection, NVS_TYPE_ANY);
+    while (it != nullptr)
+    {
+        nvs_entry_info(it, &info);
+        isSnapshotComplete = _loadCacheEntry(handle, info) && isSnapshotComplete;
+        it = nvs_entry_next(it);
+    }
+#endif
+    nvs_close(handle);
+    _isCacheLoaded = true;
+    _saveSnapshot(isSnapshotComplete);
+    log_d("Config cache loaded section=%s entries=%u", _nvramSection, _cache.size());
+}
+
+bool IotConfig::_loadCacheEntry(nvs_handle_t handle, const nvs_entry_info_t& info)
+{
+    // read the entry as raw bytes
+    uint8_t buf[8];
+    uint8_t * data = buf;
+    size_t len = 0;
+    esp_err_t err = ESP_FAIL;
+    switch (info.type)
+    {
+        case NVS_TYPE_I32: len = 4; err = nvs_get_i32(handle, info.key, (int32_t *)buf); break;
+        case NVS_TYPE_I64: len = 8; err = nvs_get_i64(handle, info.key, (int64_t *)buf); break;
+        case NVS_TYPE_U8: len = 1; err = nvs_get_u8(handle, info.key, buf); break;
+        case NVS_TYPE_STR:
+            err = nvs_get_str(handle, info.key, nullptr, &len);
+            if (err == ESP_OK)
+            {
+                data = new uint8_t[len];
+                err = nvs_get_str(handle, info.key, (char *)data, &len);
+            }
+            break;
+        case NVS_TYPE_BLOB:
+            err = nvs_get_blob(handle, info.key, nullptr, &len);
+            if (err == ESP_OK)
+            {
+                data = new uint8_t[len > 0 ? len : 1];
+                err = nvs_get_blob(handle, info.key, data, &len);
+            }
+            break;
+        default:
+            // not used by configuration values
+            return true;
+    }
+
+    bool isAppended = false;
+    if (err == ESP_OK)
+    {
+        _cacheEntry(info.type, info.key, data, len);
+        isAppended = _appendSnapshotRecord(info.type, info.key, data, len);
+    }
+    if (data != buf)
+    {
+        delete[] data;
+    }
+    return isAppended;
+}
+
+void IotConfig::_cacheEntry(nvs_type_t type, const char * key, const uint8_t * data, size_t len)
+{
+    // only the types used by the getters are cached, i.e. i32 for int32, u8 for bool and str
+    if (type == NVS_TYPE_I32 && len == 4)
+    {
+        int32_t value;
+        memcpy(&value, data, len);
+        _cache[key] = { type, value, "" };
+    } else if (type == NVS_TYPE_U8 && len == 1) {
+        _cache[key] = { type, data[0], "" };
+    } else if (type == NVS_TYPE_STR && len > 0 && data[len - 1] == '\0') {
+        _cache[key] = { type, 0, (const char *)data };
+    }
+}
+
+// *****************************************************************************
+
+bool IotConfig::_appendSnapshotRecord(nvs_type_t type, const char * key, const uint8_t * data, size_t len)
+{
+    size_t keyLen = strlen(key);
+    size_t pos = rtcConfigSnapshot.len;
+    if (pos + 4 + keyLen + len > IOT_CONFIG_RTC_SNAPSHOT_SIZE)
+    {
+        return false;
+    }
+    rtcConfigSnapshot.data[pos++] = type;
+    rtcConfigSnapshot.data[pos++] = keyLen;
+    memcpy(rtcConfigSnapshot.data + pos, key, keyLen);
+    pos += keyLen;
+    rtcConfigSnapshot.data[pos++] = len & 0xff;
+    rtcConfigSnapshot.data[pos++] = len >> 8;
+    memcpy(rtcConfigSnapshot.data + pos, data, len);
+    rtcConfigSnapshot.len = pos + len;
+    return true;
+}
+
+void IotConfig::_saveSnapshot(bool isComplete)
+{
+    if (!isComplete)
+    {
+        log_i("Config section=%s exceeds IOT_CONFIG_RTC_SNAPSHOT_SIZE, not kept in RTC RAM", _nvramSection);
+        return;
+    }
+    memset(rtcConfigSnapshot.section, 0, sizeof(rtcConfigSnapshot.section));
+    strncpy(rtcConfigSnapshot.section, _nvramSection, sizeof(rtcConfigSnapshot.section) - 1);
+    rtcConfigSnapshot.crc = snapshotCrc();
+    rtcConfigSnapshot.magic = IOT_CONFIG_SNAPSHOT_MAGIC;
+}
+
+bool IotConfig::_loadFromSnapshot()
+{
+    if (!isSnapshotValid(_nvramSection))
+    {
+        return false;
+    }
+
+    _cache.clear();
+    size_t pos = 0;
+    while (pos + 4 <= rtcConfigSnapshot.len)
+    {
+        nvs_type_t type = (nvs_type_t)rtcConfigSnapshot.data[pos++];
+        char key[NVS_KEY_NAME_MAX_SIZE];
+        size_t keyLen = rtcConfigSnapshot.data[pos++];
+        if (keyLen >= sizeof(key) || pos + keyLen + 2 > rtcConfigSnapshot.len)
+        {
+            break;
+        }
+        memcpy(key, rtcConfigSnapshot.data + pos, keyLen);
+        key[keyLen] = '\0';
+        pos += keyLen;
+        size_t len = rtcConfigSnapshot.data[pos] | (rtcConfigSnapshot.data[pos + 1] << 8);
+        pos += 2;
+        if (pos + len > rtcConfigSnapshot.len)
+        {
+            break;
+        }
+        const uint8_t * data = rtcConfigSnapshot.data + pos;
+        pos += len;
+
+        // fill the cache and publish the values registered for the key
+        _cacheEntry(type, key, data, len);
+        for (size_t i = 0; i < _configValueCount; i++)
+        {
+            if (strcmp(_configValues[i].valuePtr->getNvramKey(), key) == 0)
+            {
+                _configValues[i].valuePtr->readFromSnapshot(type, data, len);
+            }
+        }
+    }
+    _isCacheLoaded = true;
+    return true;
+}
+
+void IotConfig::_updateCache(const char * key, nvs_type_t type, int32_t intValue, const String& stringValue)
+{
+    if (_isCacheLoaded)
+    {
+        auto it = _cache.find(key);
+        if (it != _cache.end() && it->second.type == type 
+            && it->second.intValue == intValue && it->second.stringValue == stringValue)
+        {
+            return;
+        }
+        _cache[key] = { type, intValue, stringValue };
+    }
+    invalidateSnapshot();
 }
 
 // *****************************************************************************
@@ -106,21 +447,70 @@ void IotConfig::readConfigFromPreferences()
 {
     Preferences preferences;
     preferences.begin(_nvramSection, true);
-    for (auto const& kv : _configMap)
+    for (size_t i = 0; i < _configValueCount; i++)
     {
-        kv.second->readFromNvram(preferences);
+        _configValues[i].valuePtr->readFromNvram(preferences);
     }
     preferences.end();
 }
 
 void IotConfig::registerConfigValuePtr(const char *configKey, IotPersistableConfigValue* configValuePtr)
 {
-    _configMap[configKey] = configValuePtr;
+    // keep the registry sorted by key, registrations happen once during static initialization
+    size_t pos = _configValueCount;
+    while (pos > 0 && strcmp(_configValues[pos - 1].configKey, configKey) >= 0)
+    {
+        pos--;
+    }
+    if (pos < _configValueCount && strcmp(_configValues[pos].configKey, configKey) == 0)
+    {
+        _configValues[pos].valuePtr = configValuePtr;
+        return;
+    }
+    if (_configValueCount >= IOT_CONFIG_MAX_VALUES)
+    {
+        log_e("Config value %s not registered, increase IOT_CONFIG_MAX_VALUES", configKey);
+        return;
+    }
+    memmove(&_configValues[pos + 1], &_configValues[pos], (_configValueCount - pos) * sizeof(_configValues[0]));
+    _configValues[pos] = { configKey, configValuePtr };
+    _configValueCount++;
+}
+
+IotPersistableConfigValue * IotConfig::findConfigValuePtr(const char *configKey) const
+{
+    // binary search
+    size_t low = 0;
+    size_t high = _configValueCount;
+    while (low < high)
+    {
+        size_t mid = (low + high) / 2;
+        int cmp = strcmp(_configValues[mid].configKey, configKey);
+        if (cmp == 0)
+        {
+            return _configValues[mid].valuePtr;
+        } else if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return nullptr;
 }
 
 
 // *****************************************************************************
 
+/**
+ * @return false if the IM response header (RFC 3229) names an instance
+ *         manipulation other than the requested JSON merge patch
+ */
+static bool isMergePatchOrFull(std::map<String, String>& responseHeader)
+{
+    const String& im = responseHeader["IM"];
+    return im.isEmpty() || im.indexOf("merge-patch") >= 0;
+}
+
 bool IotConfig::updateConfig()
 {
     if (_apiPath == nullptr || _nvramSection == nullptr || _nvramEtagKey == nullptr || _nvramDateKey == nullptr)
@@ -129,24 +519,32 @@ bool IotConfig::updateConfig()
         return false;
     }
 
-    // get etag and last-modified date from preferences
-    Preferences preferences;
-    preferences.begin(_nvramSection, true);
-    String etag = preferences.getString(_nvramEtagKey, "");
-    String date = preferences.getString(_nvramDateKey, "");
-    preferences.end();
+    // get etag and last-modified date
+    String etag = getConfigHttpEtag();
+    String date = getConfigHttpDate();
 
-    // get config from server
-    String response = "";
+    // get config from server, storing each changed value in NVRAM while it 
+    // is received, with the section opened once
     std::map<String, String> responseHeader;
-    const char* collectResponseHeaderKeys[] =  {"ETag", "Last-Modified"};
+    const char* collectResponseHeaderKeys[] =  {"ETag", "Last-Modified", "IM"};
+    std::vector<IotPersistableConfigValue*> changedValues;
+    IotNvramTransaction transaction(_nvramSection);
+    IotJsonStreamParser parser([this, &transaction, &changedValues, &responseHeader](const char * configKey, IotJsonStreamParser::ValueType type, const char * value)
+    {
+        // the response header is complete when the body is parsed
+        if (isMergePatchOrFull(responseHeader))
+        {
+            _storeConfigValue(transaction, configKey, type, value, changedValues);
+        }
+    });
     int httpStatusCode = api.apiRequest(
-        response, responseHeader, 
-        "GET", _apiPath, "", {
+        parser, responseHeader, 
+        "GET", _apiPath, nullptr, 0, {
             {"If-None-Match", etag},
-            {"If-Modified-Since", date}
+            {"If-Modified-Since", date},
+            {"A-IM", etag.isEmpty() ? "" : "merge-patch"}
         }, 
-        collectResponseHeaderKeys, 2);
+        collectResponseHeaderKeys, 3);
 
     if (httpStatusCode < 200 || httpStatusCode >= 300)
     {
@@ -158,90 +556,184 @@ bool IotConfig::updateConfig()
         }
         return false;
     }
-
-    // decode JSON payload
-    DynamicJsonDocument doc(4096);
-    DeserializationError error = deserializeJson(doc, response);
-    if (error)
+    if (!isMergePatchOrFull(responseHeader))
     {
-        log_e("Config JSON deserialization failed error=%s", error.c_str());
+        log_e("Config delta IM=%s not supported", responseHeader["IM"].c_str());
         return false;
     }
 
-    // store config in preferences
-    preferences.begin(_nvramSection, false);
-    for (JsonPair kv : doc.as<JsonObject>())
+    // values received before a parsing error are stored already and
+    // published below; keep the etag so that the configuration is
+    // downloaded again
+    bool isComplete = parser.isDone();
+    if (!isComplete)
+    {
+        log_e("Config JSON parsing failed after %u values", parser.getMemberCount());
+    }
+
+    // update etag and last-modified date in preferences
+    if (isComplete)
     {
-        const char * configKey = kv.key().c_str();
-        if (_configMap.find(configKey) == _configMap.end())
+        for (auto const& kv : responseHeader)
         {
-            log_e("Ignoring unknown key %s", configKey);
-            continue;
+            //log_v("  HTTP response header: %s=%s", kv.first.c_str(), kv.second.c_str());
+            if (kv.first.equalsIgnoreCase("etag"))
+            {
+                transaction.put(_nvramEtagKey, kv.second);
+                _updateCache(_nvramEtagKey, NVS_TYPE_STR, 0, kv.second);
+                log_d("  Config etag=%s", kv.second.c_str());
+            } else if (kv.first.equalsIgnoreCase("last-modified"))
+            {
+                transaction.put(_nvramDateKey, kv.second);
+                _updateCache(_nvramDateKey, NVS_TYPE_STR, 0, kv.second);
+                log_d("  Config date=%s", kv.second.c_str());
+            }
         }
-        IotPersistableConfigValue* configValuePtr = _configMap[configKey];
-        const char * nvramKey = configValuePtr->getNvramKey();
+    }
+    transaction.commit();
 
-        if (kv.value().is<int>() && configValuePtr->isInt32())
+    // publish changed config values
+    Preferences preferences;
+    preferences.begin(_nvramSection, true);
+    for (IotPersistableConfigValue * configValuePtr : changedValues)
+    {
+        configValuePtr->readFromNvram(preferences);
+    }
+    preferences.end();
+    for (IotPersistableConfigValue * configValuePtr : changedValues)
+    {
+        configValuePtr->notifyChanged();
+    }
+    log_i("Configuration %s %s, changed=%u", 
+        (httpStatusCode == HTTP_CODE_IM_USED) ? "patch" : "data",
+        isComplete ? "applied" : "partially applied", changedValues.size());
+    return isComplete;
+}
+
+void IotConfig::_storeConfigValue(IotNvramTransaction& transaction, const char * configKey, 
+    IotJsonStreamParser::ValueType type, const char * value, 
+    std::vector<IotPersistableConfigValue*>& oChangedValues)
+{
+    IotPersistableConfigValue* configValuePtr = findConfigValuePtr(configKey);
+    if (configValuePtr == nullptr)
+    {
+        log_e("Ignoring unknown key %s", configKey);
+        return;
+    }
+    const char * nvramKey = configValuePtr->getNvramKey();
+    uint32_t writeCount = IotNvramTransaction::getWriteCount();
+
+    bool isStored = false;
+    char * end = nullptr;
+    if (type == IotJsonStreamParser::IOT_JSON_NULL)
+    {
+        // merge patch semantics: null removes the key, i.e. resets it to its default
+        log_d("configKey=%s nvramKey=%s removed", configKey, nvramKey);
+        if (transaction.remove(nvramKey))
         {
-            int value = kv.value().as<int>();
-            if ( !preferences.isKey(nvramKey) || (value != preferences.getInt(nvramKey)) )
+            _cache.erase(nvramKey);
+            configValuePtr->resetToDefault();
+        }
+        isStored = true;
+    } else if (type == IotJsonStreamParser::IOT_JSON_NUMBER) {
+        switch (configValuePtr->getType())
+        {
+            case IOT_CONFIG_INT32:
             {
-                log_d("configKey=%s nvramKey=%s value=%d", configKey, nvramKey, value);
-                preferences.putInt(nvramKey, value);
+                long long intValue = strtoll(value, &end, 10);
+                if (*end == '\0' && intValue >= INT32_MIN && intValue <= INT32_MAX)
+                {
+                    if (transaction.put(nvramKey, (int32_t)intValue))
+                    {
+                        _updateCache(nvramKey, NVS_TYPE_I32, intValue);
+                    }
+                    isStored = true;
+                }
+                break;
             }
-        } else if (kv.value().is<bool>() && configValuePtr->isBool())
-        {
-            bool value = kv.value().as<bool>();
-            if ( !preferences.isKey(nvramKey) || (value != preferences.getBool(nvramKey)) )
+            case IOT_CONFIG_INT64:
             {
-                log_d("configKey=%s nvramKey=%s value=%s", configKey, nvramKey, value ? "true" : "false");
-                preferences.putBool(nvramKey, value);
+                long long intValue = strtoll(value, &end, 10);
+                if (*end == '\0')
+                {
+                    transaction.put(nvramKey, (int64_t)intValue);
+                    isStored = true;
+                }
+                break;
             }
-        } else if (kv.value().is<String>() && configValuePtr->isString())
-        {
-            String value = kv.value().as<String>();
-            if ( !preferences.isKey(nvramKey) || (value != preferences.getString(nvramKey)) )
+            case IOT_CONFIG_FLOAT:
             {
-                log_d("configKey=%s nvramKey=%s value=%s", configKey, nvramKey, value.c_str());
-                preferences.putString(nvramKey, value);
+                float floatValue = strtof(value, &end);
+                if (*end == '\0')
+                {
+                    transaction.putBytes(nvramKey, &floatValue, sizeof(floatValue));
+                    isStored = true;
+                }
+                break;
             }
-        } else
+            case IOT_CONFIG_DOUBLE:
+            {
+                double doubleValue = strtod(value, &end);
+                if (*end == '\0')
+                {
+                    transaction.putBytes(nvramKey, &doubleValue, sizeof(doubleValue));
+                    isStored = true;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    } else if (type == IotJsonStreamParser::IOT_JSON_BOOL && configValuePtr->isBool()) {
+        bool boolValue = (value[0] == 't');
+        if (transaction.put(nvramKey, boolValue))
         {
-            log_e("Ignoring configKey=%s nvramKey=%s, check types", configKey);
+            _updateCache(nvramKey, NVS_TYPE_U8, boolValue ? 1 : 0);
         }
-    }
-
-    // update etag and last-modified date in preferences
-    for (auto const& kv : responseHeader)
-    {
-        //log_v("  HTTP response header: %s=%s", kv.first.c_str(), kv.second.c_str());
-        if (kv.first.equalsIgnoreCase("etag"))
+        isStored = true;
+    } else if (type == IotJsonStreamParser::IOT_JSON_STRING && configValuePtr->isString()) {
+        if (transaction.put(nvramKey, value))
         {
-            preferences.putString(_nvramEtagKey, kv.second);
-            log_d("  Config etag=%s", kv.second.c_str());
-        } else if (kv.first.equalsIgnoreCase("last-modified"))
+            _updateCache(nvramKey, NVS_TYPE_STR, 0, value);
+        }
+        isStored = true;
+    } else if (type == IotJsonStreamParser::IOT_JSON_STRING && configValuePtr->getType() == IOT_CONFIG_BLOB) {
+        uint8_t blob[IOT_JSON_STREAM_MAX_VALUE_LEN * 3 / 4 + 3];
+        size_t blobLen = 0;
+        if (mbedtls_base64_decode(blob, sizeof(blob), &blobLen, (const unsigned char *)value, strlen(value)) == 0)
         {
-            preferences.putString(_nvramDateKey, kv.second);
-            log_d("  Config date=%s", kv.second.c_str());
+            transaction.putBytes(nvramKey, blob, blobLen);
+            isStored = true;
         }
     }
 
-    // publish config values
-    for (auto const& kv : _configMap)
+    if (isStored)
     {
-        kv.second->readFromNvram(preferences);
+        log_d("configKey=%s nvramKey=%s value=%s", configKey, nvramKey, value);
+    } else {
+        log_e("Ignoring configKey=%s nvramKey=%s, check types", configKey, nvramKey);
     }
 
-    // cleanup
-    preferences.end();
-    log_i("Configuration data update finished");
-    return true;
+    // dirty set of values to publish and notify once
+    if (IotNvramTransaction::getWriteCount() != writeCount)
+    {
+        invalidateSnapshot();
+        if (std::find(oChangedValues.begin(), oChangedValues.end(), configValuePtr) == oChangedValues.end())
+        {
+            oChangedValues.push_back(configValuePtr);
+        }
+    }
 }
 
 // *****************************************************************************
 
 int32_t IotConfig::getConfigInt32(const char *key, int32_t defaultValue)
 {
+    if (_isCacheLoaded)
+    {
+        auto it = _cache.find(key);
+        return (it != _cache.end() && it->second.type == NVS_TYPE_I32) ? it->second.intValue : defaultValue;
+    }
     Preferences preferences;
     preferences.begin(_nvramSection, true);
     int value = preferences.getInt(key, defaultValue);
@@ -251,14 +743,24 @@ int32_t IotConfig::getConfigInt32(const char *key, int32_t defaultValue)
 
 void IotConfig::setConfigInt32(const char *key, int32_t value)
 {
-    Preferences preferences;
-    preferences.begin(_nvramSection, false);
-    preferences.putInt(key, value);
-    preferences.end();
+    if (getConfigInt32(key, ~value) == value)
+    {
+        return;
+    }
+    IotNvramTransaction transaction(_nvramSection);
+    if (transaction.put(key, value))
+    {
+        _updateCache(key, NVS_TYPE_I32, value);
+    }
 }
 
 bool IotConfig::getConfigBool(const char *key, bool defaultValue)
 {
+    if (_isCacheLoaded)
+    {
+        auto it = _cache.find(key);
+        return (it != _cache.end() && it->second.type == NVS_TYPE_U8) ? it->second.intValue == 1 : defaultValue;
+    }
     Preferences preferences;
     preferences.begin(_nvramSection, true);
     bool value = preferences.getBool(key, defaultValue);
@@ -268,14 +770,24 @@ bool IotConfig::getConfigBool(const char *key, bool defaultValue)
 
 void IotConfig::setConfigBool(const char *key, bool value)
 {
-    Preferences preferences;
-    preferences.begin(_nvramSection, false);
-    preferences.putBool(key, value);
-    preferences.end();
+    if (getConfigBool(key, !value) == value)
+    {
+        return;
+    }
+    IotNvramTransaction transaction(_nvramSection);
+    if (transaction.put(key, value))
+    {
+        _updateCache(key, NVS_TYPE_U8, value ? 1 : 0);
+    }
 }
 
 String IotConfig::getConfigString(const char *key, String defaultValue)
 {
+    if (_isCacheLoaded)
+    {
+        auto it = _cache.find(key);
+        return (it != _cache.end() && it->second.type == NVS_TYPE_STR) ? it->second.stringValue : defaultValue;
+    }
     Preferences preferences;
     preferences.begin(_nvramSection, true);
     String value = preferences.getString(key, defaultValue);
@@ -285,10 +797,19 @@ String IotConfig::getConfigString(const char *key, String defaultValue)
 
 void IotConfig::setConfigString(const char *key, String value)
 {
-    Preferences preferences;
-    preferences.begin(_nvramSection, false);
-    preferences.putString(key, value.c_str());
-    preferences.end();
+    if (_isCacheLoaded)
+    {
+        auto it = _cache.find(key);
+        if (it != _cache.end() && it->second.type == NVS_TYPE_STR && it->second.stringValue == value)
+        {
+            return;
+        }
+    }
+    IotNvramTransaction transaction(_nvramSection);
+    if (transaction.put(key, value))
+    {
+        _updateCache(key, NVS_TYPE_STR, 0, value);
+    }
 }
 
 
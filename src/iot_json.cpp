@@ -0,0 +1,475 @@
+/**
+ * ESP32 generic firmware (Arduino based)
+ * Copyright (c) 2023 clausgf@github. See LICENSE.md for legal information.
+ */
+
+#include "iot_json.h"
+
+#include <cmath>
+
+// *****************************************************************************
+
+IotJsonWriter::IotJsonWriter(char * buf, size_t bufLen):
+    _buf(buf),
+    _bufLen(bufLen)
+{
+    clear();
+}
+
+void IotJsonWriter::clear()
+{
+    _len = 0;
+    _isOverflow = (_buf == nullptr || _bufLen == 0);
+    _needsComma = false;
+    if (!_isOverflow)
+    {
+        _buf[0] = '\0';
+    }
+}
+
+// *****************************************************************************
+
+void IotJsonWriter::_append(char c)
+{
+    if (_len + 1 >= _bufLen)
+    {
+        _isOverflow = true;
+        return;
+    }
+    _buf[_len++] = c;
+    _buf[_len] = '\0';
+}
+
+void IotJsonWriter::_append(const char * str, size_t len)
+{
+    if (_len + len >= _bufLen)
+    {
+        _isOverflow = true;
+        return;
+    }
+    memcpy(_buf + _len, str, len);
+    _len += len;
+    _buf[_len] = '\0';
+}
+
+void IotJsonWriter::_beginValue()
+{
+    if (_needsComma)
+    {
+        _append(',');
+    }
+    _needsComma = true;
+}
+
+void IotJsonWriter::_appendEscaped(const char * str)
+{
+    _append('"');
+    for (const char * p = str; *p != '\0' && !_isOverflow; p++)
+    {
+        char c = *p;
+        switch (c)
+        {
+            case '"':  _append("\\\"", 2); break;
+            case '\\': _append("\\\\", 2); break;
+            case '\b': _append("\\b", 2); break;
+            case '\f': _append("\\f", 2); break;
+            case '\n': _append("\\n", 2); break;
+            case '\r': _append("\\r", 2); break;
+            case '\t': _append("\\t", 2); break;
+            default:
+                if ((unsigned char)c < 0x20)
+                {
+                    char hex[7];
+                    snprintf(hex, sizeof(hex), "\\u%04x", c);
+                    _append(hex, 6);
+                } else {
+                    _append(c);
+                }
+        }
+    }
+    _append('"');
+}
+
+// *****************************************************************************
+
+IotJsonWriter& IotJsonWriter::beginObject()
+{
+    _beginValue();
+    _append('{');
+    _needsComma = false;
+    return *this;
+}
+
+IotJsonWriter& IotJsonWriter::endObject()
+{
+    _append('}');
+    _needsComma = true;
+    return *this;
+}
+
+IotJsonWriter& IotJsonWriter::beginArray()
+{
+    _beginValue();
+    _append('[');
+    _needsComma = false;
+    return *this;
+}
+
+IotJsonWriter& IotJsonWriter::endArray()
+{
+    _append(']');
+    _needsComma = true;
+    return *this;
+}
+
+IotJsonWriter& IotJsonWriter::key(const char * name)
+{
+    _beginValue();
+    _appendEscaped(name);
+    _append(':');
+    _needsComma = false;
+    return *this;
+}
+
+// *****************************************************************************
+
+IotJsonWriter& IotJsonWriter::value(long long v)
+{
+    if (v < 0)
+    {
+        _beginValue();
+        _append('-');
+        _needsComma = false;
+        // avoid overflow for the most negative value
+        return value((unsigned long long)(-(v + 1)) + 1);
+    }
+    return value((unsigned long long)v);
+}
+
+IotJsonWriter& IotJsonWriter::value(unsigned long long v)
+{
+    _beginValue();
+    char digits[20];
+    int n = 0;
+    do
+    {
+        digits[n++] = '0' + (v % 10);
+        v /= 10;
+    } while (v != 0);
+    while (n > 0)
+    {
+        _append(digits[--n]);
+    }
+    return *this;
+}
+
+IotJsonWriter& IotJsonWriter::value(double v, int decimals)
+{
+    if (std::isnan(v) || std::isinf(v))
+    {
+        return valueNull();
+    }
+    _beginValue();
+    char num[32];
+    int n = snprintf(num, sizeof(num), "%.*f", decimals, v);
+    if (n < 0 || n >= (int)sizeof(num))
+    {
+        n = snprintf(num, sizeof(num), "%g", v);
+    }
+    _append(num, n);
+    return *this;
+}
+
+IotJsonWriter& IotJsonWriter::value(bool v)
+{
+    _beginValue();
+    if (v)
+    {
+        _append("true", 4);
+    } else {
+        _append("false", 5);
+    }
+    return *this;
+}
+
+IotJsonWriter& IotJsonWriter::value(const char * v)
+{
+    if (v == nullptr)
+    {
+        return valueNull();
+    }
+    _beginValue();
+    _appendEscaped(v);
+    return *this;
+}
+
+IotJsonWriter& IotJsonWriter::valueNull()
+{
+    _beginValue();
+    _append("null", 4);
+    return *this;
+}
+
+IotJsonWriter& IotJsonWriter::rawValue(const char * json)
+{
+    _beginValue();
+    _append(json, strlen(json));
+    return *this;
+}
+
+// *****************************************************************************
+// IotJsonStreamParser
+// *****************************************************************************
+
+static bool isJsonWhitespace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+IotJsonStreamParser::IotJsonStreamParser(MemberCallback callback):
+    _callback(callback)
+{
+    clear();
+}
+
+void IotJsonStreamParser::clear()
+{
+    _state = S_START;
+    _key[0] = '\0';
+    _value[0] = '\0';
+    _keyLen = 0;
+    _valueLen = 0;
+    _isTruncated = false;
+    _isEscape = false;
+    _unicodeDigits = 0;
+    _unicode = 0;
+    _depth = 0;
+    _isInNestedString = false;
+    _memberCount = 0;
+}
+
+size_t IotJsonStreamParser::write(const uint8_t * buf, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        _feed(buf[i]);
+    }
+    return size;
+}
+
+// *****************************************************************************
+
+void IotJsonStreamParser::_error(char c)
+{
+    log_e("JSON parse error at unexpected character '%c' after key=%s", c, _key);
+    _state = S_ERROR;
+}
+
+void IotJsonStreamParser::_startString()
+{
+    _isEscape = false;
+    _unicodeDigits = 0;
+}
+
+void IotJsonStreamParser::_appendChar(char c, char * buf, size_t bufSize, size_t& len)
+{
+    if (len + 1 >= bufSize)
+    {
+        _isTruncated = true;
+        return;
+    }
+    buf[len++] = c;
+    buf[len] = '\0';
+}
+
+bool IotJsonStreamParser::_appendStringChar(char c, char * buf, size_t bufSize, size_t& len)
+{
+    if (_unicodeDigits > 0)
+    {
+        // collect the hex digits of \uXXXX, then append the code point as UTF-8
+        uint8_t digit;
+        if (c >= '0' && c <= '9') { digit = c - '0'; }
+        else if (c >= 'a' && c <= 'f') { digit = c - 'a' + 10; }
+        else if (c >= 'A' && c <= 'F') { digit = c - 'A' + 10; }
+        else { _error(c); return false; }
+        _unicode = (_unicode << 4) | digit;
+        if (--_unicodeDigits == 0)
+        {
+            if (_unicode < 0x80)
+            {
+                _appendChar(_unicode, buf, bufSize, len);
+            } else if (_unicode < 0x800) {
+                _appendChar(0xc0 | (_unicode >> 6), buf, bufSize, len);
+                _appendChar(0x80 | (_unicode & 0x3f), buf, bufSize, len);
+            } else {
+                // surrogate pairs are not combined
+                _appendChar(0xe0 | (_unicode >> 12), buf, bufSize, len);
+                _appendChar(0x80 | ((_unicode >> 6) & 0x3f), buf, bufSize, len);
+                _appendChar(0x80 | (_unicode & 0x3f), buf, bufSize, len);
+            }
+        }
+        return false;
+    }
+    if (_isEscape)
+    {
+        _isEscape = false;
+        switch (c)
+        {
+            case 'b': _appendChar('\b', buf, bufSize, len); break;
+            case 'f': _appendChar('\f', buf, bufSize, len); break;
+            case 'n': _appendChar('\n', buf, bufSize, len); break;
+            case 'r': _appendChar('\r', buf, bufSize, len); break;
+            case 't': _appendChar('\t', buf, bufSize, len); break;
+            case 'u': _unicodeDigits = 4; _unicode = 0; break;
+            default: _appendChar(c, buf, bufSize, len); break;
+        }
+        return false;
+    }
+    if (c == '\\')
+    {
+        _isEscape = true;
+        return false;
+    }
+    if (c == '"')
+    {
+        return true;
+    }
+    _appendChar(c, buf, bufSize, len);
+    return false;
+}
+
+// *****************************************************************************
+
+void IotJsonStreamParser::_emit(ValueType type)
+{
+    if (_isTruncated)
+    {
+        log_e("JSON member key=%s skipped, key or value too long", _key);
+    } else if (_callback) {
+        _callback(_key, type, _value);
+        _memberCount++;
+    }
+    _state = S_COMMA_OR_END;
+}
+
+void IotJsonStreamParser::_finishLiteral()
+{
+    if (strcmp(_value, "true") == 0 || strcmp(_value, "false") == 0)
+    {
+        _emit(IOT_JSON_BOOL);
+    } else if (strcmp(_value, "null") == 0) {
+        _emit(IOT_JSON_NULL);
+    } else if (_value[0] == '-' || (_value[0] >= '0' && _value[0] <= '9')) {
+        _emit(IOT_JSON_NUMBER);
+    } else {
+        _error(_value[0]);
+    }
+}
+
+void IotJsonStreamParser::_feed(char c)
+{
+    switch (_state)
+    {
+        case S_START:
+            if (c == '{') { _state = S_KEY_OR_END; }
+            else if (!isJsonWhitespace(c)) { _error(c); }
+            break;
+
+        case S_KEY_OR_END:
+            if (c == '"')
+            {
+                _keyLen = 0;
+                _key[0] = '\0';
+                _isTruncated = false;
+                _startString();
+                _state = S_KEY;
+            } else if (c == '}') {
+                _state = S_DONE;
+            } else if (!isJsonWhitespace(c)) {
+                _error(c);
+            }
+            break;
+
+        case S_KEY:
+            if (_appendStringChar(c, _key, sizeof(_key), _keyLen))
+            {
+                _state = S_COLON;
+            }
+            break;
+
+        case S_COLON:
+            if (c == ':') { _state = S_VALUE; }
+            else if (!isJsonWhitespace(c)) { _error(c); }
+            break;
+
+        case S_VALUE:
+            _valueLen = 0;
+            _value[0] = '\0';
+            if (c == '"')
+            {
+                _startString();
+                _state = S_STRING;
+            } else if (c == '{' || c == '[') {
+                _depth = 1;
+                _isInNestedString = false;
+                _startString();
+                _state = S_NESTED;
+            } else if (isalnum(c) || c == '-') {
+                _appendChar(c, _value, sizeof(_value), _valueLen);
+                _state = S_LITERAL;
+            } else if (!isJsonWhitespace(c)) {
+                _error(c);
+            }
+            break;
+
+        case S_STRING:
+            if (_appendStringChar(c, _value, sizeof(_value), _valueLen))
+            {
+                _emit(IOT_JSON_STRING);
+            }
+            break;
+
+        case S_LITERAL:
+            if (isalnum(c) || c == '-' || c == '+' || c == '.')
+            {
+                _appendChar(c, _value, sizeof(_value), _valueLen);
+            } else {
+                _finishLiteral();
+                if (_state != S_ERROR)
+                {
+                    _feed(c);
+                }
+            }
+            break;
+
+        case S_NESTED:
+            if (_isInNestedString)
+            {
+                if (_isEscape) { _isEscape = false; }
+                else if (c == '\\') { _isEscape = true; }
+                else if (c == '"') { _isInNestedString = false; }
+            } else if (c == '"') {
+                _isInNestedString = true;
+            } else if (c == '{' || c == '[') {
+                _depth++;
+            } else if (c == '}' || c == ']') {
+                if (--_depth == 0)
+                {
+                    _emit(IOT_JSON_NESTED);
+                }
+            }
+            break;
+
+        case S_COMMA_OR_END:
+            if (c == ',') { _state = S_KEY_OR_END; }
+            else if (c == '}') { _state = S_DONE; }
+            else if (!isJsonWhitespace(c)) { _error(c); }
+            break;
+
+        case S_DONE:
+        case S_ERROR:
+            break;
+    }
+}
+
+// *****************************************************************************
@@ -3,6 +3,8 @@
  * Copyright (c) 2023 clausgf@github. See LICENSE.md for legal information.
  */
 
+#include <algorithm>
+
 #include "Arduino.h"
 #include "iot_api.h"
 
@@ -20,6 +22,19 @@ IotLogger logger;
 IotLogger::IotLogger()
 {
     _logLevel = LogLevel::IOT_LOGLEVEL_NOTSET;
+
+    _buffer = nullptr;
+    _bufferSize = 2048;
+    _bufferLen = 0;
+    _flushThreshold = 1536;
+    _maxAge_ms = 5000;
+    _bufferStart_ms = 0;
+    _droppedCount = 0;
+    _reportedDroppedCount = 0;
+    _flushFailed_ms = 0;
+    _flushRetryDelay_ms = 0;
+    _isFlushing = false;
+    _isDeferred = false;
 }
 
 void IotLogger::begin(LogLevel logLevel)
@@ -29,10 +44,20 @@ void IotLogger::begin(LogLevel logLevel)
 
 void IotLogger::end()
 {
+    flush();
+    delete[] _buffer;
+    _buffer = nullptr;
+    _bufferLen = 0;
 }
 
 // *****************************************************************************
 
+static char logLevelChar(int level)
+{
+    const char * ESP_LOG_LEVEL_CHARS = "EWIDV";
+    return (level >= 0 && level < 5) ? ESP_LOG_LEVEL_CHARS[level] : '?';
+}
+
 void IotLogger::setLogLevel(LogLevel level)
 {
     _logLevel = level;
@@ -43,34 +68,724 @@ void IotLogger::logv(LogLevel level, const char *tag, const char* format, va_lis
     // TODO logging is not reentrant - do we need to change this?
     if (level <= _logLevel)
     {
-        const char * ESP_LOG_LEVEL_CHARS = "EWIDV";
+        unsigned long now_ms = millis();
+        bool isConnected = (WiFi.status() == WL_CONNECTED);
+
+        // deferred formatting: store format pointer and raw arguments only
+        if (_isDeferred && isConnected && _bufferSize > 0)
+        {
+            log_i("Logging level=%d tag=%s format=\"%s\"", level, tag, format);
+            _appendRecordToBuffer(level, tag, now_ms, format, ap);
+            loop();
+            return;
+        }
+
         const int logBufLen = 160;
         char logBuf[logBufLen];
 
         // print header
-        int logLevelIndex = int(level);
-        char logLevelChar = '?';
-        if (logLevelIndex < strlen(ESP_LOG_LEVEL_CHARS))
-        {
-            logLevelChar = ESP_LOG_LEVEL_CHARS[logLevelIndex];
-        }
-        int headerChars = snprintf(logBuf, logBufLen, "%c (%lu) %s: ", logLevelChar, millis(), tag);
+        int headerChars = snprintf(logBuf, logBufLen, "%c (%lu) %s: ", logLevelChar(level), now_ms, tag);
 
         // print the message itself
         vsnprintf(logBuf + headerChars, logBufLen - headerChars, format, ap);
 
         // actual log output
         log_i("Logging level=%d tag=%s msg=\"%s\"", level, tag, logBuf);
-        if (WiFi.status() == WL_CONNECTED) {
-            postLog(logBuf);
+        if (isConnected) {
+            if (_bufferSize == 0)
+            {
+                postLog(logBuf);
+            } else {
+                _appendToBuffer(logBuf);
+                loop();
+            }
+        } else {
+            _appendToJournal(level, tag, now_ms, logBuf + headerChars);
+        }
+    }
+}
+
+// *****************************************************************************
+// RTC RAM journal
+// *****************************************************************************
+
+// Log lines which cannot be posted are kept in RTC RAM across deep sleep.
+// Each record consists of
+// - 1 byte: log level (bits 5..7) and tag index (bits 0..4)
+// - 4 bytes: millis() at the time of logging
+// - 1 byte: text length
+// - text without terminating zero
+// Tags are stored once in a small table. If the table is full, or the
+// record was formatted already, the tag index is IOT_LOG_JOURNAL_RAW
+// and the text is a complete log line.
+
+#define IOT_LOG_JOURNAL_MAGIC 0x494c4a31  // "ILJ1"
+#define IOT_LOG_JOURNAL_DATA_SIZE 1024
+#define IOT_LOG_JOURNAL_TAGS 16
+#define IOT_LOG_JOURNAL_TAG_LEN 12
+#define IOT_LOG_JOURNAL_RAW 0x1f
+#define IOT_LOG_JOURNAL_HEADER_LEN 6
+
+struct IotLogJournal
+{
+    uint32_t magic;
+    uint16_t used;
+    uint16_t dropped;
+    char tags[IOT_LOG_JOURNAL_TAGS][IOT_LOG_JOURNAL_TAG_LEN];
+    uint8_t data[IOT_LOG_JOURNAL_DATA_SIZE];
+};
+
+RTC_DATA_ATTR static IotLogJournal rtcLogJournal;
+
+static bool isJournalValid()
+{
+    return rtcLogJournal.magic == IOT_LOG_JOURNAL_MAGIC && rtcLogJournal.used <= IOT_LOG_JOURNAL_DATA_SIZE;
+}
+
+static void clearJournal()
+{
+    memset(&rtcLogJournal, 0, sizeof(rtcLogJournal));
+    rtcLogJournal.magic = IOT_LOG_JOURNAL_MAGIC;
+}
+
+static uint8_t journalTagIndex(const char * tag)
+{
+    for (int i = 0; i < IOT_LOG_JOURNAL_TAGS; i++)
+    {
+        if (rtcLogJournal.tags[i][0] == '\0')
+        {
+            if (strlen(tag) >= IOT_LOG_JOURNAL_TAG_LEN)
+            {
+                return IOT_LOG_JOURNAL_RAW;
+            }
+            strncpy(rtcLogJournal.tags[i], tag, IOT_LOG_JOURNAL_TAG_LEN);
+            return i;
+        }
+        if (strncmp(rtcLogJournal.tags[i], tag, IOT_LOG_JOURNAL_TAG_LEN) == 0)
+        {
+            return i;
+        }
+    }
+    return IOT_LOG_JOURNAL_RAW;
+}
+
+size_t IotLogger::getJournalLength() const
+{
+    return isJournalValid() ? rtcLogJournal.used : 0;
+}
+
+void IotLogger::_appendToJournal(LogLevel level, const char * tag, unsigned long ms, const char * text)
+{
+    if (!isJournalValid())
+    {
+        clearJournal();
+    }
+
+    const int lineBufLen = 160;
+    char lineBuf[lineBufLen];
+    uint8_t tagIndex = (tag == nullptr) ? IOT_LOG_JOURNAL_RAW : journalTagIndex(tag);
+    if (tagIndex == IOT_LOG_JOURNAL_RAW && tag != nullptr)
+    {
+        snprintf(lineBuf, lineBufLen, "%c (%lu) %s: %s", logLevelChar(level), ms, tag, text);
+        text = lineBuf;
+    }
+    size_t textLen = strlen(text);
+    if (textLen > 255)
+    {
+        textLen = 255;
+    }
+    size_t recordLen = IOT_LOG_JOURNAL_HEADER_LEN + textLen;
+
+    // drop the oldest records to make room for the new one
+    while (rtcLogJournal.used > 0 && rtcLogJournal.used + recordLen > IOT_LOG_JOURNAL_DATA_SIZE)
+    {
+        size_t oldestLen = IOT_LOG_JOURNAL_HEADER_LEN + rtcLogJournal.data[IOT_LOG_JOURNAL_HEADER_LEN - 1];
+        memmove(rtcLogJournal.data, rtcLogJournal.data + oldestLen, rtcLogJournal.used - oldestLen);
+        rtcLogJournal.used -= oldestLen;
+        rtcLogJournal.dropped++;
+    }
+
+    uint8_t * record = rtcLogJournal.data + rtcLogJournal.used;
+    uint32_t ms32 = ms;
+    record[0] = (uint8_t(level) << 5) | tagIndex;
+    memcpy(record + 1, &ms32, sizeof(ms32));
+    record[5] = textLen;
+    memcpy(record + IOT_LOG_JOURNAL_HEADER_LEN, text, textLen);
+    rtcLogJournal.used += recordLen;
+}
+
+void IotLogger::_journalToString(String& oText) const
+{
+    if (!isJournalValid() || rtcLogJournal.used == 0)
+    {
+        return;
+    }
+
+    oText.reserve(oText.length() + rtcLogJournal.used + rtcLogJournal.used / 2);
+    if (rtcLogJournal.dropped > 0)
+    {
+        oText += "W (0) logger: ";
+        oText += rtcLogJournal.dropped;
+        oText += " log lines dropped from journal\n";
+    }
+
+    const int lineBufLen = 300;
+    char lineBuf[lineBufLen];
+    size_t pos = 0;
+    while (pos + IOT_LOG_JOURNAL_HEADER_LEN <= rtcLogJournal.used)
+    {
+        const uint8_t * record = rtcLogJournal.data + pos;
+        uint8_t level = record[0] >> 5;
+        uint8_t tagIndex = record[0] & 0x1f;
+        uint32_t ms32;
+        memcpy(&ms32, record + 1, sizeof(ms32));
+        size_t textLen = record[5];
+        const char * text = (const char *)(record + IOT_LOG_JOURNAL_HEADER_LEN);
+
+        if (tagIndex == IOT_LOG_JOURNAL_RAW || tagIndex >= IOT_LOG_JOURNAL_TAGS)
+        {
+            snprintf(lineBuf, lineBufLen, "%.*s\n", (int)textLen, text);
+        } else {
+            snprintf(lineBuf, lineBufLen, "%c (%lu) %.*s: %.*s\n", logLevelChar(level), (unsigned long)ms32,
+                IOT_LOG_JOURNAL_TAG_LEN, rtcLogJournal.tags[tagIndex], (int)textLen, text);
+        }
+        oText += lineBuf;
+        pos += IOT_LOG_JOURNAL_HEADER_LEN + textLen;
+    }
+}
+
+void IotLogger::_persistBuffer()
+{
+    if (_bufferLen == 0)
+    {
+        return;
+    }
+
+    if (_isDeferred)
+    {
+        // format the binary records now, the journal keeps text only
+        const int lineBufLen = 160;
+        char lineBuf[lineBufLen];
+        size_t pos = 0;
+        while (pos < _bufferLen)
+        {
+            pos += _formatRecord((const uint8_t *)_buffer + pos, lineBuf, lineBufLen);
+            _appendToJournal(IOT_LOGLEVEL_INFO, nullptr, 0, lineBuf);
+        }
+    } else {
+        // split the buffer into lines, which are complete log lines already
+        char * line = _buffer;
+        while (line < _buffer + _bufferLen)
+        {
+            char * eol = strchr(line, '\n');
+            if (eol == nullptr)
+            {
+                break;
+            }
+            *eol = '\0';
+            _appendToJournal(IOT_LOGLEVEL_INFO, nullptr, 0, line);
+            line = eol + 1;
+        }
+    }
+    _bufferLen = 0;
+    _buffer[0] = '\0';
+}
+
+void IotLogger::persistToJournal(const char * lines)
+{
+    String text = lines;
+    int start = 0;
+    while (start < (int)text.length())
+    {
+        int eol = text.indexOf('\n', start);
+        if (eol < 0)
+        {
+            eol = text.length();
+        }
+        if (eol > start)
+        {
+            _appendToJournal(IOT_LOGLEVEL_INFO, nullptr, 0, text.substring(start, eol).c_str());
+        }
+        start = eol + 1;
+    }
+}
+
+// *****************************************************************************
+// Buffering
+// *****************************************************************************
+
+// After a failed flush, automatic flushes are delayed, doubling the delay
+// with each failure, so that logging does not wait for a request per line
+// while the server is unreachable.
+#define IOT_LOG_FLUSH_RETRY_MIN_MS 2000
+#define IOT_LOG_FLUSH_RETRY_MAX_MS 60000
+
+void IotLogger::setBuffer(size_t bufferSize, size_t flushThreshold, unsigned long maxAge_ms)
+{
+    flush();
+    delete[] _buffer;
+    _buffer = nullptr;
+    _bufferLen = 0;
+    _bufferSize = bufferSize;
+    _flushThreshold = flushThreshold < bufferSize ? flushThreshold : bufferSize;
+    _maxAge_ms = maxAge_ms;
+}
+
+void IotLogger::setDeferredFormatting(bool deferred)
+{
+    if (deferred == _isDeferred)
+    {
+        return;
+    }
+    flush(true);
+    _bufferLen = 0;
+    _isDeferred = deferred;
+}
+
+char * IotLogger::_reserveBuffer(size_t len)
+{
+    if (_buffer == nullptr)
+    {
+        _buffer = new char[_bufferSize];
+        if (_buffer == nullptr)
+        {
+            _droppedCount++;
+            return nullptr;
+        }
+        _buffer[0] = '\0';
+        _bufferLen = 0;
+    }
+
+    // make room by flushing first unless a flush failed recently, 
+    // then drop if the data still does not fit
+    if (_bufferLen + len + 1 > _bufferSize && !_isFlushRetryDelayed())
+    {
+        flush();
+    }
+    if (_bufferLen + len + 1 > _bufferSize)
+    {
+        _droppedCount++;
+        return nullptr;
+    }
+
+    if (_bufferLen == 0)
+    {
+        _bufferStart_ms = millis();
+    }
+    char * ptr = _buffer + _bufferLen;
+    _bufferLen += len;
+    _buffer[_bufferLen] = '\0';
+    return ptr;
+}
+
+bool IotLogger::_appendToBuffer(const char * line)
+{
+    size_t lineLen = strlen(line);
+    char * ptr = _reserveBuffer(lineLen + 1);
+    if (ptr == nullptr)
+    {
+        return false;
+    }
+    memcpy(ptr, line, lineLen);
+    ptr[lineLen] = '\n';
+    return true;
+}
+
+void IotLogger::_bufferToString(String& oText) const
+{
+    if (_bufferLen == 0)
+    {
+        return;
+    }
+    if (!_isDeferred)
+    {
+        oText += _buffer;
+        return;
+    }
+
+    const int lineBufLen = 160;
+    char lineBuf[lineBufLen];
+    size_t pos = 0;
+    while (pos < _bufferLen)
+    {
+        pos += _formatRecord((const uint8_t *)_buffer + pos, lineBuf, lineBufLen);
+        oText += lineBuf;
+        oText += '\n';
+    }
+}
+
+bool IotLogger::_isFlushRetryDelayed() const
+{
+    return _flushRetryDelay_ms > 0 && millis() - _flushFailed_ms < _flushRetryDelay_ms;
+}
+
+bool IotLogger::_isFlushDue() const
+{
+    if (_bufferLen == 0 || _isFlushRetryDelayed())
+    {
+        return false;
+    }
+    return (_bufferLen >= _flushThreshold) || (millis() - _bufferStart_ms >= _maxAge_ms);
+}
+
+void IotLogger::loop()
+{
+    if (_isFlushDue())
+    {
+        flush();
+    }
+}
+
+int IotLogger::flush(bool persistOnFailure)
+{
+    // avoid recursion if the API logs while flushing
+    if (_isFlushing || (_bufferLen == 0 && getJournalLength() == 0))
+    {
+        return 0;
+    }
+    if (WiFi.status() != WL_CONNECTED)
+    {
+        if (persistOnFailure)
+        {
+            _persistBuffer();
         }
+        return 0;
+    }
+    _isFlushing = true;
+
+    if (_droppedCount != _reportedDroppedCount)
+    {
+        log_w("Dropped %u log lines due to a full log buffer", _droppedCount - _reportedDroppedCount);
+        _reportedDroppedCount = _droppedCount;
+    }
+
+    // lines from the journal precede the buffered lines in a single request
+    int httpStatusCode;
+    bool hasJournal = getJournalLength() > 0;
+    if (hasJournal || _isDeferred)
+    {
+        String body;
+        _journalToString(body);
+        _bufferToString(body);
+        httpStatusCode = postLog(body.c_str());
+    } else {
+        httpStatusCode = postLog(_buffer);
     }
+
+    if (httpStatusCode >= 200 && httpStatusCode < 300)
+    {
+        if (hasJournal)
+        {
+            clearJournal();
+        }
+        if (_bufferLen > 0)
+        {
+            _bufferLen = 0;
+            _buffer[0] = '\0';
+        }
+        _flushRetryDelay_ms = 0;
+    } else {
+        _flushFailed_ms = millis();
+        _flushRetryDelay_ms = (_flushRetryDelay_ms == 0) ? IOT_LOG_FLUSH_RETRY_MIN_MS 
+            : std::min(2 * _flushRetryDelay_ms, (unsigned long)IOT_LOG_FLUSH_RETRY_MAX_MS);
+        log_w("Log flush failed status=%d, next attempt in %lu ms", httpStatusCode, _flushRetryDelay_ms);
+        if (persistOnFailure)
+        {
+            _persistBuffer();
+        } else {
+            // keep the lines for the next attempt, but restart the age timer
+            _bufferStart_ms = millis();
+        }
+    }
+
+    _isFlushing = false;
+    return httpStatusCode;
+}
+
+// *****************************************************************************
+// Deferred formatting
+// *****************************************************************************
+
+// A deferred record stores the arguments of a log call instead of the
+// formatted text:
+// - 1 byte: log level
+// - 4 bytes: millis() at the time of logging
+// - pointer: tag
+// - pointer: format string, or nullptr if the text was formatted already
+// - 2 bytes: length of the argument data
+// - argument data in the order of the conversions in the format string:
+//   native representation of integers, doubles and pointers;
+//   strings are copied as 1 byte length plus characters, strings longer
+//   than IOT_LOG_RECORD_MAX_STRING_LEN are truncated and end with "..."
+// Tag and format string are referenced, not copied. They must be string
+// literals, which reside in flash and are valid for the whole runtime.
+
+#define IOT_LOG_RECORD_HEADER_LEN (1 + 4 + 2 * sizeof(const char *) + 2)
+#define IOT_LOG_RECORD_MAX_ARGS_LEN 96
+static_assert(IOT_LOG_RECORD_MAX_STRING_LEN >= 4 && IOT_LOG_RECORD_MAX_STRING_LEN <= 255,
+    "IOT_LOG_RECORD_MAX_STRING_LEN must fit into the 1 byte string length");
+
+enum LogArgType { LOG_ARG_NONE, LOG_ARG_INT, LOG_ARG_LONG, LOG_ARG_LONGLONG, LOG_ARG_SIZE, 
+    LOG_ARG_DOUBLE, LOG_ARG_STRING, LOG_ARG_POINTER, LOG_ARG_UNSUPPORTED };
+
+/**
+ * Parse the next conversion specification in format starting at *pos.
+ * Literal text is skipped, "%%" is treated as literal text.
+ * @return the argument type, LOG_ARG_NONE at the end of the format string;
+ *         *specStart and *pos delimit the conversion specification
+ */
+static LogArgType nextConversion(const char * format, size_t * pos, size_t * specStart)
+{
+    size_t i = *pos;
+    while (format[i] != '\0')
+    {
+        if (format[i] != '%')
+        {
+            i++;
+            continue;
+        }
+        if (format[i + 1] == '%')
+        {
+            i += 2;
+            continue;
+        }
+
+        *specStart = i++;
+        while (strchr("-+ #0", format[i]) != nullptr && format[i] != '\0') { i++; }
+        while (isdigit((unsigned char)format[i])) { i++; }
+        if (format[i] == '.')
+        {
+            i++;
+            while (isdigit((unsigned char)format[i])) { i++; }
+        }
+        if (format[i] == '*' || format[i] == '\0')
+        {
+            *pos = i;
+            return LOG_ARG_UNSUPPORTED;
+        }
+
+        int longCount = 0;
+        bool isSize = false;
+        while (strchr("hlzjtLq", format[i]) != nullptr && format[i] != '\0')
+        {
+            if (format[i] == 'l') { longCount++; }
+            else if (format[i] == 'j' || format[i] == 'q') { longCount = 2; }
+            else if (format[i] == 'z') { isSize = true; }
+            else if (format[i] == 't' || format[i] == 'L') { *pos = i + 1; return LOG_ARG_UNSUPPORTED; }
+            i++;
+        }
+
+        char conversion = format[i];
+        *pos = (conversion != '\0') ? i + 1 : i;
+        switch (conversion)
+        {
+            case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+                if (isSize) { return LOG_ARG_SIZE; }
+                if (longCount >= 2) { return LOG_ARG_LONGLONG; }
+                if (longCount == 1) { return LOG_ARG_LONG; }
+                return LOG_ARG_INT;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                return LOG_ARG_DOUBLE;
+            case 's':
+                return LOG_ARG_STRING;
+            case 'p':
+                return LOG_ARG_POINTER;
+            default:
+                return LOG_ARG_UNSUPPORTED;
+        }
+    }
+    *pos = i;
+    return LOG_ARG_NONE;
+}
+
+/**
+ * Serialize the arguments referenced by ap according to format.
+ * @return the number of bytes written or -1 if the format is not supported
+ *         or the arguments do not fit into the given buffer
+ */
+static int encodeArgs(uint8_t * buf, size_t bufLen, const char * format, va_list ap)
+{
+    size_t len = 0;
+    size_t pos = 0;
+    size_t specStart = 0;
+    for (;;)
+    {
+        LogArgType type = nextConversion(format, &pos, &specStart);
+        if (type == LOG_ARG_NONE)
+        {
+            return len;
+        }
+
+        uint8_t argBuf[sizeof(double) > sizeof(long long) ? sizeof(double) : sizeof(long long)];
+        const void * argPtr = argBuf;
+        size_t argLen = 0;
+        switch (type)
+        {
+            case LOG_ARG_INT:      { int v = va_arg(ap, int); argLen = sizeof(v); memcpy(argBuf, &v, argLen); break; }
+            case LOG_ARG_LONG:     { long v = va_arg(ap, long); argLen = sizeof(v); memcpy(argBuf, &v, argLen); break; }
+            case LOG_ARG_LONGLONG: { long long v = va_arg(ap, long long); argLen = sizeof(v); memcpy(argBuf, &v, argLen); break; }
+            case LOG_ARG_SIZE:     { size_t v = va_arg(ap, size_t); argLen = sizeof(v); memcpy(argBuf, &v, argLen); break; }
+            case LOG_ARG_DOUBLE:   { double v = va_arg(ap, double); argLen = sizeof(v); memcpy(argBuf, &v, argLen); break; }
+            case LOG_ARG_POINTER:  { void * v = va_arg(ap, void *); argLen = sizeof(v); memcpy(argBuf, &v, argLen); break; }
+            case LOG_ARG_STRING:
+            {
+                const char * v = va_arg(ap, const char *);
+                if (v == nullptr) { v = "(null)"; }
+                size_t strLen = strnlen(v, IOT_LOG_RECORD_MAX_STRING_LEN + 1);
+                bool isTruncated = (strLen > IOT_LOG_RECORD_MAX_STRING_LEN);
+                if (isTruncated) { strLen = IOT_LOG_RECORD_MAX_STRING_LEN; }
+                if (len + 1 + strLen > bufLen) { return -1; }
+                buf[len++] = strLen;
+                memcpy(buf + len, v, strLen);
+                if (isTruncated) { memcpy(buf + len + strLen - 3, "...", 3); }
+                len += strLen;
+                continue;
+            }
+            default:
+                return -1;
+        }
+        if (len + argLen > bufLen) { return -1; }
+        memcpy(buf + len, argPtr, argLen);
+        len += argLen;
+    }
+}
+
+/**
+ * Format the message of a record from its format string and serialized arguments.
+ */
+static void formatArgs(char * out, size_t outLen, const char * format, const uint8_t * args, size_t argsLen)
+{
+    size_t outPos = 0;
+    size_t argPos = 0;
+    size_t pos = 0;
+    size_t literalStart = 0;
+    size_t specStart = 0;
+    const int specBufLen = 16;
+    char specBuf[specBufLen];
+    char strBuf[IOT_LOG_RECORD_MAX_STRING_LEN + 1];
+
+    for (;;)
+    {
+        LogArgType type = nextConversion(format, &pos, &specStart);
+        size_t literalEnd = (type == LOG_ARG_NONE) ? pos : specStart;
+
+        // copy literal text, collapsing "%%"
+        for (size_t i = literalStart; i < literalEnd && outPos + 1 < outLen; i++)
+        {
+            out[outPos++] = format[i];
+            if (format[i] == '%' && format[i + 1] == '%') { i++; }
+        }
+        out[outPos] = '\0';
+        if (type == LOG_ARG_NONE || outPos + 1 >= outLen)
+        {
+            return;
+        }
+        literalStart = pos;
+
+        size_t specLen = pos - specStart;
+        if (specLen >= specBufLen)
+        {
+            return;
+        }
+        memcpy(specBuf, format + specStart, specLen);
+        specBuf[specLen] = '\0';
+
+        int n = 0;
+        size_t remaining = outLen - outPos;
+        switch (type)
+        {
+            case LOG_ARG_INT:      { int v; memcpy(&v, args + argPos, sizeof(v)); argPos += sizeof(v); n = snprintf(out + outPos, remaining, specBuf, v); break; }
+            case LOG_ARG_LONG:     { long v; memcpy(&v, args + argPos, sizeof(v)); argPos += sizeof(v); n = snprintf(out + outPos, remaining, specBuf, v); break; }
+            case LOG_ARG_LONGLONG: { long long v; memcpy(&v, args + argPos, sizeof(v)); argPos += sizeof(v); n = snprintf(out + outPos, remaining, specBuf, v); break; }
+            case LOG_ARG_SIZE:     { size_t v; memcpy(&v, args + argPos, sizeof(v)); argPos += sizeof(v); n = snprintf(out + outPos, remaining, specBuf, v); break; }
+            case LOG_ARG_DOUBLE:   { double v; memcpy(&v, args + argPos, sizeof(v)); argPos += sizeof(v); n = snprintf(out + outPos, remaining, specBuf, v); break; }
+            case LOG_ARG_POINTER:  { void * v; memcpy(&v, args + argPos, sizeof(v)); argPos += sizeof(v); n = snprintf(out + outPos, remaining, specBuf, v); break; }
+            case LOG_ARG_STRING:
+            {
+                size_t strLen = args[argPos++];
+                memcpy(strBuf, args + argPos, strLen);
+                strBuf[strLen] = '\0';
+                argPos += strLen;
+                n = snprintf(out + outPos, remaining, specBuf, strBuf);
+                break;
+            }
+            default:
+                return;
+        }
+        if (argPos > argsLen || n < 0)
+        {
+            return;
+        }
+        outPos += ((size_t)n < remaining) ? n : remaining - 1;
+    }
+}
+
+bool IotLogger::_appendRecordToBuffer(LogLevel level, const char * tag, unsigned long ms, const char * format, va_list ap)
+{
+    uint8_t args[IOT_LOG_RECORD_MAX_ARGS_LEN];
+    va_list apCopy;
+    va_copy(apCopy, ap);
+    int argsLen = encodeArgs(args, sizeof(args), format, apCopy);
+    va_end(apCopy);
+
+    // fall back to immediate formatting for unsupported formats
+    if (argsLen < 0)
+    {
+        argsLen = vsnprintf((char *)args, sizeof(args), format, ap);
+        argsLen = (argsLen < (int)sizeof(args)) ? argsLen : sizeof(args) - 1;
+        format = nullptr;
+    }
+
+    uint8_t * record = (uint8_t *)_reserveBuffer(IOT_LOG_RECORD_HEADER_LEN + argsLen);
+    if (record == nullptr)
+    {
+        return false;
+    }
+    uint32_t ms32 = ms;
+    uint16_t argsLen16 = argsLen;
+    record[0] = level;
+    memcpy(record + 1, &ms32, sizeof(ms32));
+    memcpy(record + 5, &tag, sizeof(tag));
+    memcpy(record + 5 + sizeof(tag), &format, sizeof(format));
+    memcpy(record + 5 + 2 * sizeof(const char *), &argsLen16, sizeof(argsLen16));
+    memcpy(record + IOT_LOG_RECORD_HEADER_LEN, args, argsLen);
+    return true;
+}
+
+size_t IotLogger::_formatRecord(const uint8_t * record, char * out, size_t outLen) const
+{
+    uint32_t ms32;
+    const char * tag;
+    const char * format;
+    uint16_t argsLen;
+    memcpy(&ms32, record + 1, sizeof(ms32));
+    memcpy(&tag, record + 5, sizeof(tag));
+    memcpy(&format, record + 5 + sizeof(tag), sizeof(format));
+    memcpy(&argsLen, record + 5 + 2 * sizeof(const char *), sizeof(argsLen));
+    const uint8_t * args = record + IOT_LOG_RECORD_HEADER_LEN;
+
+    int headerChars = snprintf(out, outLen, "%c (%lu) %s: ", logLevelChar(record[0]), (unsigned long)ms32, tag);
+    if (headerChars < 0 || (size_t)headerChars >= outLen)
+    {
+        return IOT_LOG_RECORD_HEADER_LEN + argsLen;
+    }
+    if (format == nullptr)
+    {
+        snprintf(out + headerChars, outLen - headerChars, "%.*s", (int)argsLen, (const char *)args);
+    } else {
+        formatArgs(out + headerChars, outLen - headerChars, format, args, argsLen);
+    }
+    return IOT_LOG_RECORD_HEADER_LEN + argsLen;
 }
 
 // *****************************************************************************
 
 void IotLogger::logf(LogLevel level, const char *tag, const char* format...)
 {
+    if (!isLevelEnabled(level))
+    {
+        return;
+    }
     va_list args;
     va_start(args, format);
     logv(level, tag, format, args);
@@ -79,6 +794,10 @@ void IotLogger::logf(LogLevel level, const char *tag, const char* format...)
 
 void IotLogger::error(const char *tag, const char* format...)
 {
+    if (!isLevelEnabled(LogLevel::IOT_LOGLEVEL_ERROR))
+    {
+        return;
+    }
     va_list args;
     va_start(args, format);
     logv(LogLevel::IOT_LOGLEVEL_ERROR, tag, format, args);
@@ -87,6 +806,10 @@ void IotLogger::error(const char *tag, const char* format...)
 
 void IotLogger::warn(const char *tag, const char* format...)
 {
+    if (!isLevelEnabled(LogLevel::IOT_LOGLEVEL_WARNING))
+    {
+        return;
+    }
     va_list args;
     va_start(args, format);
     logv(LogLevel::IOT_LOGLEVEL_WARNING, tag, format, args);
@@ -95,6 +818,10 @@ void IotLogger::warn(const char *tag, const char* format...)
 
 void IotLogger::info(const char *tag, const char* format...)
 {
+    if (!isLevelEnabled(LogLevel::IOT_LOGLEVEL_INFO))
+    {
+        return;
+    }
     va_list args;
     va_start(args, format);
     logv(LogLevel::IOT_LOGLEVEL_INFO, tag, format, args);
@@ -103,6 +830,10 @@ void IotLogger::info(const char *tag, const char* format...)
 
 void IotLogger::debug(const char *tag, const char* format...)
 {
+    if (!isLevelEnabled(LogLevel::IOT_LOGLEVEL_DEBUG))
+    {
+        return;
+    }
     va_list args;
     va_start(args, format);
     logv(LogLevel::IOT_LOGLEVEL_DEBUG, tag, format, args);
@@ -111,6 +842,10 @@ void IotLogger::debug(const char *tag, const char* format...)
 
 void IotLogger::verbose(const char *tag, const char* format...)
 {
+    if (!isLevelEnabled(LogLevel::IOT_LOGLEVEL_VERBOSE))
+    {
+        return;
+    }
     va_list args;
     va_start(args, format);
     logv(LogLevel::IOT_LOGLEVEL_VERBOSE, tag, format, args);
@@ -121,8 +856,11 @@ void IotLogger::verbose(const char *tag, const char* format...)
 
 int IotLogger::postLog(const char * body, const char * apiPath)
 {
-    String oResult = "";
-    return api.apiPost(oResult, apiPath, body, {{"Content-Type", "text/plain"}});
+    if (api.isBatching())
+    {
+        return api.addToBatch("log", apiPath, body, "text/plain");
+    }
+    return api.apiPost(apiPath, (const uint8_t *)body, strlen(body), {{"Content-Type", "text/plain"}});
 }
 
 // *****************************************************************************
@@ -0,0 +1,239 @@
+/**
+ * ESP32 generic firmware (Arduino based)
+ * Copyright (c) 2023 clausgf@github. See LICENSE.md for legal information.
+ */
+
+#include "iot_telemetry_queue.h"
+
+#include <vector>
+
+#include "iot_api.h"
+#include "iot.h"
+
+// *****************************************************************************
+
+IotTelemetryQueue telemetryQueue;
+
+// Each record is stored as a blob in its own slot:
+// - 8 bytes: time the data was recorded
+// - 1 byte: length of the API path
+// - API path
+// - body
+#define IOT_TQ_RECORD_HEADER_LEN 9
+#define IOT_TQ_MAX_RECORD_LEN 2000
+static const char * metaKey = "meta";
+
+// *****************************************************************************
+
+IotTelemetryQueue::IotTelemetryQueue():
+    _nvramSection(nullptr),
+    _maxRecords(0),
+    _maxBytes(0),
+    _maxAge_s(0),
+    _meta({0, 0, 0, 0, 0})
+{
+}
+
+void IotTelemetryQueue::begin(const char * nvramSection, uint16_t maxRecords, size_t maxBytes, uint32_t maxAge_s)
+{
+    if (maxRecords == 0)
+    {
+        log_e("Telemetry queue not enabled, maxRecords must not be 0");
+        return;
+    }
+    _nvramSection = nvramSection;
+    _maxRecords = maxRecords;
+    _maxBytes = maxBytes;
+    _maxAge_s = maxAge_s;
+
+    Preferences preferences;
+    preferences.begin(_nvramSection, false);
+    if (preferences.getBytes(metaKey, &_meta, sizeof(_meta)) != sizeof(_meta) || _meta.head - _meta.tail > 0xffff)
+    {
+        _meta = {0, 0, 0, 0, _maxRecords};
+    }
+    if (_meta.slots != _maxRecords)
+    {
+        // the records are stored in slots of a different ring size
+        log_w("Telemetry queue reset, records=%u slots changed from %u to %u", getCount(), _meta.slots, _maxRecords);
+        preferences.clear();
+        _meta = {0, 0, 0, 0, _maxRecords};
+        _writeMeta(preferences);
+    }
+    preferences.end();
+
+    if (getCount() > 0)
+    {
+        log_i("Telemetry queue section=%s records=%u bytes=%u dropped=%u",
+            _nvramSection, getCount(), getBytes(), getDroppedCount());
+    }
+}
+
+void IotTelemetryQueue::end()
+{
+    _nvramSection = nullptr;
+}
+
+// *****************************************************************************
+
+void IotTelemetryQueue::_recordKey(uint32_t seq, char * key, size_t keyLen) const
+{
+    snprintf(key, keyLen, "r%u", (unsigned)(seq % _maxRecords));
+}
+
+void IotTelemetryQueue::_writeMeta(Preferences& preferences)
+{
+    preferences.putBytes(metaKey, &_meta, sizeof(_meta));
+}
+
+void IotTelemetryQueue::_removeOldest(Preferences& preferences, bool isDropped)
+{
+    char key[8];
+    _recordKey(_meta.tail, key, sizeof(key));
+    size_t len = preferences.getBytesLength(key);
+    preferences.remove(key);
+    _meta.bytes = (_meta.bytes > len) ? _meta.bytes - len : 0;
+    _meta.tail++;
+    if (isDropped)
+    {
+        _meta.dropped++;
+    }
+}
+
+// *****************************************************************************
+
+bool IotTelemetryQueue::push(time_t time, const String& apiPath, const String& body)
+{
+    size_t len = IOT_TQ_RECORD_HEADER_LEN + apiPath.length() + body.length();
+    if (!isEnabled() || apiPath.length() > 255 || len > IOT_TQ_MAX_RECORD_LEN || len > _maxBytes)
+    {
+        log_e("Telemetry not queued, queue disabled or record too large len=%u", len);
+        return false;
+    }
+
+    uint8_t * record = new uint8_t[len];
+    if (record == nullptr)
+    {
+        return false;
+    }
+    // the clock is not set yet, e.g. offline after a cold boot
+    int64_t time64 = iot.isTimePlausible(time) ? time : 0;
+    memcpy(record, &time64, sizeof(time64));
+    record[8] = apiPath.length();
+    memcpy(record + IOT_TQ_RECORD_HEADER_LEN, apiPath.c_str(), apiPath.length());
+    memcpy(record + IOT_TQ_RECORD_HEADER_LEN + apiPath.length(), body.c_str(), body.length());
+
+    Preferences preferences;
+    preferences.begin(_nvramSection, false);
+    while (getCount() > 0 && (getCount() >= _maxRecords || _meta.bytes + len > _maxBytes))
+    {
+        _removeOldest(preferences, true);
+    }
+    char key[8];
+    _recordKey(_meta.head, key, sizeof(key));
+    bool success = (preferences.putBytes(key, record, len) == len);
+    if (success)
+    {
+        _meta.head++;
+        _meta.bytes += len;
+    }
+    _writeMeta(preferences);
+    preferences.end();
+    delete[] record;
+
+    log_i("Telemetry queued path=%s records=%u bytes=%u", apiPath.c_str(), getCount(), getBytes());
+    return success;
+}
+
+// *****************************************************************************
+
+int IotTelemetryQueue::drain(size_t maxRecords)
+{
+    if (!isEnabled() || getCount() == 0 || api.isBatching())
+    {
+        return 0;
+    }
+
+    struct Record
+    {
+        time_t time;
+        String apiPath;
+        String body;
+    };
+    std::vector<Record> records;
+    time_t now = time(nullptr);
+
+    // read the oldest records, dropping expired ones
+    Preferences preferences;
+    preferences.begin(_nvramSection, false);
+    uint32_t seq = _meta.tail;
+    while (seq != _meta.head && records.size() < maxRecords)
+    {
+        char key[8];
+        _recordKey(seq, key, sizeof(key));
+        size_t len = preferences.getBytesLength(key);
+        uint8_t * buf = (len >= IOT_TQ_RECORD_HEADER_LEN && len <= IOT_TQ_MAX_RECORD_LEN) ? new uint8_t[len + 1] : nullptr;
+        if (buf == nullptr || preferences.getBytes(key, buf, len) != len || buf[8] > len - IOT_TQ_RECORD_HEADER_LEN)
+        {
+            log_e("Dropping corrupt telemetry record key=%s", key);
+            delete[] buf;
+            _removeOldest(preferences, true);
+            seq = _meta.tail;
+            continue;
+        }
+
+        int64_t time64;
+        memcpy(&time64, buf, sizeof(time64));
+        buf[len] = '\0';
+        size_t pathLen = buf[8];
+        Record record;
+        record.time = iot.isTimePlausible(time64) ? time64 : 0;
+        record.apiPath = String((const char *)buf + IOT_TQ_RECORD_HEADER_LEN).substring(0, pathLen);
+        record.body = (const char *)buf + IOT_TQ_RECORD_HEADER_LEN + pathLen;
+        delete[] buf;
+
+        // records without a plausible time never expire
+        if (records.empty() && record.time != 0 && now > record.time + (time_t)_maxAge_s)
+        {
+            log_i("Dropping expired telemetry record key=%s", key);
+            _removeOldest(preferences, true);
+            seq = _meta.tail;
+            continue;
+        }
+        records.push_back(record);
+        seq++;
+    }
+
+    // upload in a single batch
+    int removed = 0;
+    if (!records.empty())
+    {
+        api.beginBatch(IOT_TQ_MAX_RECORD_LEN * records.size());
+        for (auto const& record : records)
+        {
+            api.addToBatch("telemetry", record.apiPath, record.body, "application/json", record.time);
+        }
+        std::vector<int> itemStatus;
+        int httpStatusCode = api.flushBatch(&itemStatus);
+
+        // keep all records if the batch request failed, e.g. without batch endpoint;
+        // otherwise remove records accepted or rejected, keep the rest in order
+        for (size_t i = 0; httpStatusCode >= 200 && httpStatusCode < 300 && i < itemStatus.size(); i++)
+        {
+            int status = itemStatus[i];
+            if ((status < 200 || status >= 300) && (status < 400 || status >= 500))
+            {
+                break;
+            }
+            _removeOldest(preferences, false);
+            removed++;
+        }
+    }
+
+    _writeMeta(preferences);
+    preferences.end();
+    log_i("Telemetry queue drained=%d remaining=%u", removed, getCount());
+    return removed;
+}
+
+// *****************************************************************************
@@ -0,0 +1,378 @@
+/**
+ * ESP32 generic firmware (Arduino based)
+ * Copyright (c) 2023 clausgf@github. See LICENSE.md for legal information.
+ */
+
+#include "iot_tls.h"
+
+#include <WiFi.h>
+#include <esp_rom_crc.h>
+#include <lwip/sockets.h>
+#include <lwip/netdb.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/version.h>
+
+// *****************************************************************************
+
+// mbedtls 3 (ESP-IDF 5) makes most struct members private
+#if MBEDTLS_VERSION_MAJOR >= 3
+#define IOT_TLS_PRIVATE(member) MBEDTLS_PRIVATE(member)
+#else
+#define IOT_TLS_PRIVATE(member) member
+#endif
+
+#define IOT_TLS_SESSION_CACHE_MAGIC 0x49545331  // "ITS1"
+#define IOT_TLS_SESSION_HOST_LEN 64
+
+struct IotTlsSessionCache
+{
+    uint32_t magic;
+    uint32_t crc;
+    uint16_t port;
+    uint16_t len;
+    char host[IOT_TLS_SESSION_HOST_LEN];
+    uint8_t data[IOT_TLS_SESSION_CACHE_SIZE];
+};
+
+RTC_DATA_ATTR static IotTlsSessionCache rtcTlsSessionCache;
+RTC_DATA_ATTR static uint32_t rtcTlsResumedCount = 0;
+RTC_DATA_ATTR static uint32_t rtcTlsFullHandshakeCount = 0;
+
+static uint32_t sessionCacheCrc()
+{
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)rtcTlsSessionCache.host, sizeof(rtcTlsSessionCache.host));
+    crc = esp_rom_crc32_le(crc, (const uint8_t *)&rtcTlsSessionCache.port, sizeof(rtcTlsSessionCache.port));
+    return esp_rom_crc32_le(crc, rtcTlsSessionCache.data, rtcTlsSessionCache.len);
+}
+
+static bool isSessionCached(const char *host, uint16_t port)
+{
+    return rtcTlsSessionCache.magic == IOT_TLS_SESSION_CACHE_MAGIC
+        && rtcTlsSessionCache.len > 0 && rtcTlsSessionCache.len <= IOT_TLS_SESSION_CACHE_SIZE
+        && rtcTlsSessionCache.port == port
+        && strncmp(rtcTlsSessionCache.host, host, IOT_TLS_SESSION_HOST_LEN) == 0
+        && rtcTlsSessionCache.crc == sessionCacheCrc();
+}
+
+// *****************************************************************************
+
+IotWiFiClientSecure::IotWiFiClientSecure():
+    WiFiClientSecure(),
+    _lastHandshakeDuration_ms(0)
+{
+}
+
+void IotWiFiClientSecure::clearSessionCache()
+{
+    memset(&rtcTlsSessionCache, 0, sizeof(rtcTlsSessionCache));
+}
+
+uint32_t IotWiFiClientSecure::getResumedCount()
+{
+    return rtcTlsResumedCount;
+}
+
+uint32_t IotWiFiClientSecure::getFullHandshakeCount()
+{
+    return rtcTlsFullHandshakeCount;
+}
+
+// *****************************************************************************
+
+int IotWiFiClientSecure::connect(const char *host, uint16_t port, int32_t timeout)
+{
+    _timeout = timeout;
+    return connect(host, port);
+}
+
+int IotWiFiClientSecure::connect(const char *host, uint16_t port)
+{
+    unsigned long start_ms = millis();
+    bool isSupported = !_use_ca_bundle && _pskIdent == nullptr && (_use_insecure || _CA_cert != nullptr);
+
+    // try an abbreviated handshake with the cached session first
+    if (isSupported && isSessionCached(host, port))
+    {
+        bool isResumed = false;
+        if (_connectWithSession(host, port, _timeout, &isResumed))
+        {
+            _lastHandshakeDuration_ms = millis() - start_ms;
+            if (isResumed)
+            {
+                rtcTlsResumedCount++;
+                log_i("TLS session resumed host=%s in %lu ms", host, _lastHandshakeDuration_ms);
+            } else {
+                rtcTlsFullHandshakeCount++;
+                log_i("TLS session rejected by host=%s, full handshake in %lu ms", host, _lastHandshakeDuration_ms);
+            }
+            return 1;
+        }
+        log_w("TLS connection with cached session failed host=%s, retrying without", host);
+        clearSessionCache();
+        start_ms = millis();
+    }
+
+    // full handshake
+    int ret = WiFiClientSecure::connect(host, port);
+    if (ret)
+    {
+        _lastHandshakeDuration_ms = millis() - start_ms;
+        rtcTlsFullHandshakeCount++;
+        log_i("TLS full handshake host=%s in %lu ms", host, _lastHandshakeDuration_ms);
+        if (isSupported)
+        {
+            _saveSession(host, port);
+        }
+    }
+    return ret;
+}
+
+// *****************************************************************************
+
+/**
+ * Serialize a session exported by mbedtls_ssl_get_session() to the cache,
+ * or clear the cache if exportErr indicates that the export failed.
+ */
+static void storeSession(const char *host, uint16_t port, const mbedtls_ssl_session * session, int exportErr)
+{
+    if (strlen(host) >= IOT_TLS_SESSION_HOST_LEN)
+    {
+        return;
+    }
+
+    int err = exportErr;
+    size_t len = 0;
+    if (err == 0)
+    {
+        err = mbedtls_ssl_session_save(session, rtcTlsSessionCache.data, IOT_TLS_SESSION_CACHE_SIZE, &len);
+    }
+
+    if (err != 0)
+    {
+        log_w("TLS session not cached, error=-0x%x len=%u", -err, len);
+        IotWiFiClientSecure::clearSessionCache();
+        return;
+    }
+    memset(rtcTlsSessionCache.host, 0, sizeof(rtcTlsSessionCache.host));
+    strncpy(rtcTlsSessionCache.host, host, IOT_TLS_SESSION_HOST_LEN - 1);
+    rtcTlsSessionCache.port = port;
+    rtcTlsSessionCache.len = len;
+    rtcTlsSessionCache.crc = sessionCacheCrc();
+    rtcTlsSessionCache.magic = IOT_TLS_SESSION_CACHE_MAGIC;
+    log_d("TLS session cached len=%u", len);
+}
+
+void IotWiFiClientSecure::_saveSession(const char *host, uint16_t port)
+{
+    // mbedtls 3 allows a single export of a TLS 1.2 session per connection
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    int err = mbedtls_ssl_get_session(&sslclient->ssl_ctx, &session);
+    storeSession(host, port, &session, err);
+    mbedtls_ssl_session_free(&session);
+}
+
+// *****************************************************************************
+
+static int connectSocket(const char *host, uint16_t port, int32_t timeout)
+{
+    IPAddress serverIp((uint32_t)0);
+    if (!WiFiGenericClass::hostByName(host, serverIp))
+    {
+        log_e("TLS connect: DNS lookup failed host=%s", host);
+        return -1;
+    }
+
+    int fd = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0)
+    {
+        log_e("TLS connect: socket creation failed errno=%d", errno);
+        return -1;
+    }
+
+    struct sockaddr_in serverAddr;
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = (uint32_t)serverIp;
+    serverAddr.sin_port = htons(port);
+
+    // non-blocking connect with timeout
+    lwip_fcntl(fd, F_SETFL, lwip_fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    int res = lwip_connect(fd, (struct sockaddr *)&serverAddr, sizeof(serverAddr));
+    if (res < 0 && errno != EINPROGRESS)
+    {
+        log_e("TLS connect: connect failed errno=%d", errno);
+        lwip_close(fd);
+        return -1;
+    }
+
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(fd, &fdset);
+    struct timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    res = lwip_select(fd + 1, nullptr, &fdset, nullptr, &tv);
+    int sockErr = 0;
+    socklen_t sockErrLen = sizeof(sockErr);
+    if (res > 0)
+    {
+        lwip_getsockopt(fd, SOL_SOCKET, SO_ERROR, &sockErr, &sockErrLen);
+    }
+    if (res <= 0 || sockErr != 0)
+    {
+        log_e("TLS connect: connect timeout or error res=%d errno=%d", res, sockErr);
+        lwip_close(fd);
+        return -1;
+    }
+
+    lwip_setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    lwip_setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    int enable = 1;
+    lwip_setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    lwip_setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+    return fd;
+}
+
+int IotWiFiClientSecure::_connectWithSession(const char *host, uint16_t port, int32_t timeout, bool *oResumed)
+{
+    // release a previous connection, stop() also frees the mbedtls contexts
+    stop();
+    if (timeout <= 0)
+    {
+        timeout = 30000;
+    }
+
+    // restore the cached session
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    int err = mbedtls_ssl_session_load(&session, rtcTlsSessionCache.data, rtcTlsSessionCache.len);
+    if (err != 0)
+    {
+        log_w("TLS session restore failed error=-0x%x", -err);
+        mbedtls_ssl_session_free(&session);
+        return 0;
+    }
+
+    int fd = connectSocket(host, port, timeout);
+    if (fd < 0)
+    {
+        mbedtls_ssl_session_free(&session);
+        return 0;
+    }
+    sslclient->socket = fd;
+
+    // configure mbedtls like start_ssl_client() does, plus the cached session
+    mbedtls_ssl_init(&sslclient->ssl_ctx);
+    mbedtls_ssl_config_init(&sslclient->ssl_conf);
+    mbedtls_ctr_drbg_init(&sslclient->drbg_ctx);
+    mbedtls_entropy_init(&sslclient->entropy_ctx);
+    mbedtls_x509_crt_init(&sslclient->ca_cert);
+    mbedtls_x509_crt_init(&sslclient->client_cert);
+    mbedtls_pk_init(&sslclient->client_key);
+
+    const char *pers = "esp32-tls";
+    err = mbedtls_ctr_drbg_seed(&sslclient->drbg_ctx, mbedtls_entropy_func,
+        &sslclient->entropy_ctx, (const unsigned char *)pers, strlen(pers));
+    if (err == 0)
+    {
+        err = mbedtls_ssl_config_defaults(&sslclient->ssl_conf,
+            MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    }
+    if (err == 0 && _alpn_protos != nullptr)
+    {
+        err = mbedtls_ssl_conf_alpn_protocols(&sslclient->ssl_conf, _alpn_protos);
+    }
+    if (err == 0 && _use_insecure)
+    {
+        mbedtls_ssl_conf_authmode(&sslclient->ssl_conf, MBEDTLS_SSL_VERIFY_NONE);
+    } else if (err == 0) {
+        err = mbedtls_x509_crt_parse(&sslclient->ca_cert, (const unsigned char *)_CA_cert, strlen(_CA_cert) + 1);
+        mbedtls_ssl_conf_ca_chain(&sslclient->ssl_conf, &sslclient->ca_cert, NULL);
+        mbedtls_ssl_conf_authmode(&sslclient->ssl_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    }
+    if (err == 0 && !_use_insecure && _cert != nullptr && _private_key != nullptr)
+    {
+        err = mbedtls_x509_crt_parse(&sslclient->client_cert, (const unsigned char *)_cert, strlen(_cert) + 1);
+        if (err == 0)
+        {
+#if MBEDTLS_VERSION_MAJOR >= 3
+            err = mbedtls_pk_parse_key(&sslclient->client_key, (const unsigned char *)_private_key, strlen(_private_key) + 1, NULL, 0,
+                mbedtls_ctr_drbg_random, &sslclient->drbg_ctx);
+#else
+            err = mbedtls_pk_parse_key(&sslclient->client_key, (const unsigned char *)_private_key, strlen(_private_key) + 1, NULL, 0);
+#endif
+        }
+        if (err == 0)
+        {
+            err = mbedtls_ssl_conf_own_cert(&sslclient->ssl_conf, &sslclient->client_cert, &sslclient->client_key);
+        }
+    }
+    if (err == 0)
+    {
+        mbedtls_ssl_conf_rng(&sslclient->ssl_conf, mbedtls_ctr_drbg_random, &sslclient->drbg_ctx);
+        err = mbedtls_ssl_setup(&sslclient->ssl_ctx, &sslclient->ssl_conf);
+    }
+    if (err == 0)
+    {
+        err = mbedtls_ssl_set_hostname(&sslclient->ssl_ctx, host);
+    }
+    if (err == 0)
+    {
+        err = mbedtls_ssl_set_session(&sslclient->ssl_ctx, &session);
+    }
+
+    // handshake
+    if (err == 0)
+    {
+        mbedtls_ssl_set_bio(&sslclient->ssl_ctx, &sslclient->socket, mbedtls_net_send, mbedtls_net_recv, NULL);
+        unsigned long handshakeStart_ms = millis();
+        while ((err = mbedtls_ssl_handshake(&sslclient->ssl_ctx)) != 0)
+        {
+            if (err != MBEDTLS_ERR_SSL_WANT_READ && err != MBEDTLS_ERR_SSL_WANT_WRITE)
+            {
+                break;
+            }
+            if (millis() - handshakeStart_ms > sslclient->handshake_timeout)
+            {
+                break;
+            }
+            vTaskDelay(2);
+        }
+    }
+    if (err == 0 && !_use_insecure && mbedtls_ssl_get_verify_result(&sslclient->ssl_ctx) != 0)
+    {
+        log_e("TLS server certificate verification failed host=%s", host);
+        err = -1;
+    }
+
+    // the session was resumed if the master secret was reused; otherwise 
+    // cache the new session, using the single export mbedtls 3 allows
+    if (err == 0)
+    {
+        mbedtls_ssl_session negotiated;
+        mbedtls_ssl_session_init(&negotiated);
+        int exportErr = mbedtls_ssl_get_session(&sslclient->ssl_ctx, &negotiated);
+        *oResumed = (exportErr == 0)
+            && (memcmp(negotiated.IOT_TLS_PRIVATE(master), session.IOT_TLS_PRIVATE(master), sizeof(session.IOT_TLS_PRIVATE(master))) == 0);
+        if (!*oResumed)
+        {
+            storeSession(host, port, &negotiated, exportErr);
+        }
+        mbedtls_ssl_session_free(&negotiated);
+    }
+    mbedtls_ssl_session_free(&session);
+
+    if (err != 0)
+    {
+        log_w("TLS handshake with cached session failed error=-0x%x", -err);
+        _lastError = err;
+        stop();
+        return 0;
+    }
+    _connected = true;
+    return 1;
+}
+
+// *****************************************************************************
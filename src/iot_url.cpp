@@ -0,0 +1,101 @@
+/**
+ * ESP32 generic firmware (Arduino based)
+ * Copyright (c) 2023 clausgf@github. See LICENSE.md for legal information.
+ */
+
+#include "iot_url.h"
+
+// *****************************************************************************
+
+IotUrlTemplate::IotUrlTemplate(const char * pattern)
+{
+    parse(pattern);
+}
+
+void IotUrlTemplate::parse(const char * pattern)
+{
+    _pattern = (pattern != nullptr) ? pattern : "";
+    _segmentCount = 0;
+    _hasVariables = false;
+
+    const char * p = _pattern.c_str();
+    size_t len = _pattern.length();
+    size_t start = 0;
+    while (start < len)
+    {
+        if (_segmentCount >= IOT_URL_TEMPLATE_MAX_SEGMENTS)
+        {
+            log_e("URL template %s has too many segments, variables are not replaced", p);
+            _segments[0] = { 0, (uint16_t)len, false };
+            _segmentCount = 1;
+            _hasVariables = false;
+            return;
+        }
+
+        // a variable is a name in braces without nested braces
+        if (p[start] == '{')
+        {
+            const char * end = strchr(p + start + 1, '}');
+            const char * nested = strchr(p + start + 1, '{');
+            if (end != nullptr && (nested == nullptr || nested > end) && end > p + start + 1)
+            {
+                _segments[_segmentCount++] = { (uint16_t)(start + 1), (uint16_t)(end - p - start - 1), true };
+                _hasVariables = true;
+                start = end - p + 1;
+                continue;
+            }
+        }
+
+        // a literal extends up to the next opening brace
+        const char * next = strchr(p + start + 1, '{');
+        size_t end = (next != nullptr) ? (next - p) : len;
+        _segments[_segmentCount++] = { (uint16_t)start, (uint16_t)(end - start), false };
+        start = end;
+    }
+}
+
+// *****************************************************************************
+
+bool IotUrlTemplate::render(char * buf, size_t bufLen, const Variable * vars, size_t varCount) const
+{
+    if (buf == nullptr || bufLen == 0)
+    {
+        return false;
+    }
+
+    const char * p = _pattern.c_str();
+    size_t pos = 0;
+    bool isComplete = true;
+    for (size_t i = 0; i < _segmentCount && isComplete; i++)
+    {
+        const Segment& segment = _segments[i];
+        const char * str = p + segment.offset;
+        size_t len = segment.len;
+        if (segment.isVariable)
+        {
+            // unknown variables are kept including their braces
+            str--;
+            len += 2;
+            for (size_t v = 0; v < varCount; v++)
+            {
+                if (strncmp(vars[v].name, p + segment.offset, segment.len) == 0 && vars[v].name[segment.len] == '\0')
+                {
+                    str = (vars[v].value != nullptr) ? vars[v].value : "";
+                    len = strlen(str);
+                    break;
+                }
+            }
+        }
+        if (pos + len >= bufLen)
+        {
+            len = bufLen - 1 - pos;
+            isComplete = false;
+        }
+        memcpy(buf + pos, str, len);
+        pos += len;
+    }
+    buf[pos] = '\0';
+    return isComplete;
+}
+
+// *****************************************************************************
@@ -7,6 +7,8 @@
 
 #include "iot_util.h"
 
+#include <esp_rom_crc.h>
+
 // *****************************************************************************
 
 template class IotPersistentValue<int32_t>;
@@ -17,12 +19,272 @@ template class IotPersistentValue<String>;
 // *****************************************************************************
 
 static PreferedPersistentStorage _preferedPersistentStorage = IOT_PERSISTENT_PREFER_NVRAM;
+static bool _isDeferredPersistentWrites = false;
 
 void setPreferedPersistentStorage(PreferedPersistentStorage preferedPersistentStorage)
 { 
     _preferedPersistentStorage = preferedPersistentStorage;
 }
 
+PreferedPersistentStorage getPreferedPersistentStorage()
+{
+    return _preferedPersistentStorage;
+}
+
+void setDeferredPersistentWrites(bool isDeferred)
+{
+    _isDeferredPersistentWrites = isDeferred;
+}
+
+bool isDeferredPersistentWrites()
+{
+    return _isDeferredPersistentWrites;
+}
+
+void flushPersistentValues()
+{
+    IotPersistableValue::flushDirty();
+}
+
+// *****************************************************************************
+
+IotPersistableValue * IotPersistableValue::_firstDirty = nullptr;
+
+IotPersistableValue::~IotPersistableValue()
+{
+    if (!_isDirty)
+    {
+        return;
+    }
+    for (IotPersistableValue ** v = &_firstDirty; *v != nullptr; v = &(*v)->_nextDirty)
+    {
+        if (*v == this)
+        {
+            *v = _nextDirty;
+            break;
+        }
+    }
+    log_w("Deferred write discarded, value destroyed before flushPersistentValues()");
+}
+
+void IotPersistableValue::markDirty()
+{
+    if (!_isDirty)
+    {
+        _isDirty = true;
+        _nextDirty = _firstDirty;
+        _firstDirty = this;
+    }
+}
+
+void IotPersistableValue::flushDirty()
+{
+    while (_firstDirty != nullptr)
+    {
+        // write all dirty values of the section of the first one in a single transaction
+        const char * section = _firstDirty->getNvramSection();
+        IotNvramTransaction transaction(section);
+        for (IotPersistableValue ** v = &_firstDirty; *v != nullptr; )
+        {
+            IotPersistableValue * value = *v;
+            if (strcmp(value->getNvramSection(), section) == 0)
+            {
+                *v = value->_nextDirty;
+                value->_nextDirty = nullptr;
+                value->_isDirty = false;
+                value->writeDeferred();
+            } else {
+                v = &value->_nextDirty;
+            }
+        }
+    }
+}
+
+
+// *****************************************************************************
+// IotNvramTransaction
+// *****************************************************************************
+
+IotNvramTransaction * IotNvramTransaction::_first = nullptr;
+uint32_t IotNvramTransaction::_writeCount = 0;
+IotNvramTransaction::WriteHandler IotNvramTransaction::_writeHandler = nullptr;
+
+IotNvramTransaction::IotNvramTransaction(const char * section):
+    _section(section),
+    _handle(0),
+    _isOpen(false),
+    _isDirty(false),
+    _parent(nullptr),
+    _next(_first)
+{
+    for (IotNvramTransaction * t = _first; t != nullptr; t = t->_next)
+    {
+        if (t->_parent == nullptr && strcmp(t->_section, section) == 0)
+        {
+            _parent = t;
+            break;
+        }
+    }
+    _first = this;
+}
+
+IotNvramTransaction::~IotNvramTransaction()
+{
+    commit();
+    if (_isOpen)
+    {
+        nvs_close(_handle);
+    }
+
+    // unlink from the list of alive transactions
+    for (IotNvramTransaction ** t = &_first; *t != nullptr; t = &(*t)->_next)
+    {
+        if (*t == this)
+        {
+            *t = _next;
+            break;
+        }
+    }
+}
+
+// *****************************************************************************
+
+bool IotNvramTransaction::_open()
+{
+    if (!_isOpen)
+    {
+        esp_err_t err = nvs_open(_section, NVS_READWRITE, &_handle);
+        if (err != ESP_OK)
+        {
+            log_e("NVRAM section=%s not opened: %s", _section, esp_err_to_name(err));
+            return false;
+        }
+        _isOpen = true;
+    }
+    return true;
+}
+
+bool IotNvramTransaction::_written(esp_err_t err, const char * key)
+{
+    if (err != ESP_OK)
+    {
+        log_e("NVRAM key '%s/%s' not written: %s", _section, key, esp_err_to_name(err));
+        return false;
+    }
+    _isDirty = true;
+    _writeCount++;
+    if (_writeHandler)
+    {
+        _writeHandler(_section, key);
+    }
+    return true;
+}
+
+IotNvramTransaction::WriteHandler IotNvramTransaction::setWriteHandler(WriteHandler writeHandler)
+{
+    WriteHandler previousHandler = _writeHandler;
+    _writeHandler = writeHandler;
+    return previousHandler;
+}
+
+bool IotNvramTransaction::put(const char * key, int32_t value)
+{
+    if (_parent != nullptr) { return _parent->put(key, value); }
+    if (!_open()) { return false; }
+    int32_t storedValue;
+    if (nvs_get_i32(_handle, key, &storedValue) == ESP_OK && storedValue == value)
+    {
+        return true;
+    }
+    return _written(nvs_set_i32(_handle, key, value), key);
+}
+
+bool IotNvramTransaction::put(const char * key, int64_t value)
+{
+    if (_parent != nullptr) { return _parent->put(key, value); }
+    if (!_open()) { return false; }
+    int64_t storedValue;
+    if (nvs_get_i64(_handle, key, &storedValue) == ESP_OK && storedValue == value)
+    {
+        return true;
+    }
+    return _written(nvs_set_i64(_handle, key, value), key);
+}
+
+bool IotNvramTransaction::put(const char * key, bool value)
+{
+    if (_parent != nullptr) { return _parent->put(key, value); }
+    if (!_open()) { return false; }
+    uint8_t storedValue;
+    if (nvs_get_u8(_handle, key, &storedValue) == ESP_OK && storedValue == (value ? 1 : 0))
+    {
+        return true;
+    }
+    return _written(nvs_set_u8(_handle, key, value ? 1 : 0), key);
+}
+
+bool IotNvramTransaction::put(const char * key, const String& value)
+{
+    if (_parent != nullptr) { return _parent->put(key, value); }
+    if (!_open()) { return false; }
+    size_t len = 0;
+    if (nvs_get_str(_handle, key, nullptr, &len) == ESP_OK && len == value.length() + 1)
+    {
+        char * storedValue = new char[len];
+        bool isEqual = (nvs_get_str(_handle, key, storedValue, &len) == ESP_OK) && (value == storedValue);
+        delete[] storedValue;
+        if (isEqual)
+        {
+            return true;
+        }
+    }
+    return _written(nvs_set_str(_handle, key, value.c_str()), key);
+}
+
+bool IotNvramTransaction::putBytes(const char * key, const void * value, size_t len)
+{
+    if (_parent != nullptr) { return _parent->putBytes(key, value, len); }
+    if (!_open()) { return false; }
+    size_t storedLen = 0;
+    if (nvs_get_blob(_handle, key, nullptr, &storedLen) == ESP_OK && storedLen == len)
+    {
+        uint8_t * storedValue = new uint8_t[len > 0 ? len : 1];
+        bool isEqual = (nvs_get_blob(_handle, key, storedValue, &storedLen) == ESP_OK) && (memcmp(storedValue, value, len) == 0);
+        delete[] storedValue;
+        if (isEqual)
+        {
+            return true;
+        }
+    }
+    return _written(nvs_set_blob(_handle, key, value, len), key);
+}
+
+bool IotNvramTransaction::remove(const char * key)
+{
+    if (_parent != nullptr) { return _parent->remove(key); }
+    if (!_open()) { return false; }
+    esp_err_t err = nvs_erase_key(_handle, key);
+    if (err == ESP_ERR_NVS_NOT_FOUND)
+    {
+        return true;
+    }
+    return _written(err, key);
+}
+
+void IotNvramTransaction::commit()
+{
+    if (_parent != nullptr || !_isDirty)
+    {
+        return;
+    }
+    esp_err_t err = nvs_commit(_handle);
+    if (err != ESP_OK)
+    {
+        log_e("NVRAM section=%s not committed: %s", _section, esp_err_to_name(err));
+    }
+    _isDirty = false;
+}
+
 
 // *****************************************************************************
 // IotPersistentValue
@@ -174,14 +436,148 @@ void IotPersistentValue<T>::set(T value)
     if (_storageType == IOT_STORAGE_RTC)
     {
         *_rtcPtr = _value;
+    } else if (_storageType == IOT_STORAGE_NVRAM_IMPLICIT && _isDeferredPersistentWrites) {
+        markDirty();
     } else if (_storageType == IOT_STORAGE_NVRAM_IMPLICIT) {
-        Preferences preferences;
-        preferences.begin(_section, false);
-        writeToNvram(preferences);
-        preferences.end();
+        writeDeferred();
     }
 }
 
+template <typename T>
+void IotPersistentValue<T>::writeDeferred()
+{
+    // joins a transaction for the section if there is one
+    IotNvramTransaction transaction(_section);
+    transaction.put(_key, _value);
+    log_i("IotPersistentValue: NVRAM key '%s/%s' updated", _section, _key);
+}
+
+// *****************************************************************************
+// IotFlashRing
+// *****************************************************************************
+
+#define IOT_FLASH_RING_SECTOR_SIZE 4096     // flash erase unit, SPI_FLASH_SEC_SIZE
+
+IotFlashRing::IotFlashRing(const char * partitionLabel):
+    _partitionLabel(partitionLabel),
+    _partition(nullptr),
+    _slotCount(0),
+    _slot(0),
+    _seq(0),
+    _value(0),
+    _hasValue(false),
+    _writeCount(0),
+    _eraseCount(0)
+{
+}
+
+uint32_t IotFlashRing::_crc(const Record& record)
+{
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)&record.seq, sizeof(record.seq));
+    return esp_rom_crc32_le(crc, (const uint8_t *)&record.value, sizeof(record.value));
+}
+
+bool IotFlashRing::begin()
+{
+    _partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, _partitionLabel);
+    if (_partition == nullptr || _partition->size < 2 * IOT_FLASH_RING_SECTOR_SIZE)
+    {
+        log_e("IotFlashRing: partition '%s' not found or smaller than two sectors", _partitionLabel);
+        _partition = nullptr;
+        return false;
+    }
+    _slotCount = (_partition->size / IOT_FLASH_RING_SECTOR_SIZE) * (IOT_FLASH_RING_SECTOR_SIZE / sizeof(Record));
+
+    // find the valid record with the highest sequence number
+    _hasValue = false;
+    Record records[16];
+    for (size_t slot = 0; slot < _slotCount; slot += 16)
+    {
+        if (esp_partition_read(_partition, slot * sizeof(Record), records, sizeof(records)) != ESP_OK)
+        {
+            log_e("IotFlashRing: partition '%s' not readable", _partitionLabel);
+            _partition = nullptr;
+            return false;
+        }
+        for (size_t i = 0; i < 16; i++)
+        {
+            const Record& record = records[i];
+            if (record.seq != 0xffffffff && record.crc == _crc(record) && (!_hasValue || record.seq > _seq))
+            {
+                _hasValue = true;
+                _slot = slot + i;
+                _seq = record.seq;
+                _value = record.value;
+            }
+        }
+    }
+    log_d("IotFlashRing: partition '%s' slots=%u seq=%u", _partitionLabel, _slotCount, _seq);
+    return true;
+}
+
+bool IotFlashRing::_isSlotErased(size_t slot)
+{
+    Record record;
+    if (esp_partition_read(_partition, slot * sizeof(Record), &record, sizeof(record)) != ESP_OK)
+    {
+        return false;
+    }
+    const uint8_t * p = (const uint8_t *)&record;
+    for (size_t i = 0; i < sizeof(record); i++)
+    {
+        if (p[i] != 0xff) { return false; }
+    }
+    return true;
+}
+
+bool IotFlashRing::set(int64_t value)
+{
+    if (_partition == nullptr)
+    {
+        log_e("IotFlashRing: not initialized - call begin() first");
+        return false;
+    }
+    if (_hasValue && value == _value)
+    {
+        return true;
+    }
+
+    const size_t slotsPerSector = IOT_FLASH_RING_SECTOR_SIZE / sizeof(Record);
+    size_t slot = _hasValue ? (_slot + 1) % _slotCount : 0;
+    if (slot % slotsPerSector != 0 && !_isSlotErased(slot))
+    {
+        // e.g. a write interrupted by a power loss: continue in the next sector
+        slot = ((slot / slotsPerSector + 1) * slotsPerSector) % _slotCount;
+    }
+    if (slot % slotsPerSector == 0)
+    {
+        esp_err_t err = esp_partition_erase_range(_partition, slot * sizeof(Record), IOT_FLASH_RING_SECTOR_SIZE);
+        if (err != ESP_OK)
+        {
+            log_e("IotFlashRing: partition '%s' not erased: %s", _partitionLabel, esp_err_to_name(err));
+            return false;
+        }
+        _eraseCount++;
+    }
+
+    Record record;
+    record.seq = _hasValue ? _seq + 1 : 0;
+    record.value = value;
+    record.crc = _crc(record);
+    esp_err_t err = esp_partition_write(_partition, slot * sizeof(Record), &record, sizeof(record));
+    if (err != ESP_OK)
+    {
+        log_e("IotFlashRing: partition '%s' not written: %s", _partitionLabel, esp_err_to_name(err));
+        return false;
+    }
+    _writeCount++;
+    _hasValue = true;
+    _slot = slot;
+    _seq = record.seq;
+    _value = value;
+    return true;
+}
+
 // *****************************************************************************
 
 bool waitUntil(std::function<bool()> isFinished, unsigned long timeout_ms, const char* logMessage)